@@ -24,6 +24,11 @@ RAOPMediaPlayer = raop_media_player_ns.class_(
 )
 
 CONF_BUFFER_FRAMES = "buffer_frames"
+BUFFER_FRAMES_AUTO = "auto"
+CONF_PRE_ROLL = "pre_roll"
+CONF_DMA_DESC_NUM = "dma_desc_num"
+CONF_DMA_FRAME_NUM = "dma_frame_num"
+CONF_LAZY_DECODE = "lazy_decode"
 
 
 def validate_esp_idf_framework(config):
@@ -44,9 +49,18 @@ CONFIG_SCHEMA = cv.All(
     .extend(
         {
             cv.Required(CONF_I2S_DOUT_PIN): pins.internal_gpio_output_pin_number,
-            cv.Optional(CONF_BUFFER_FRAMES, default=1024): cv.int_range(
-                min=512, max=2048
+            cv.Optional(CONF_BUFFER_FRAMES, default=1024): cv.Any(
+                cv.one_of(BUFFER_FRAMES_AUTO, lower=True),
+                cv.int_range(min=512, max=2048),
             ),
+            cv.Optional(CONF_PRE_ROLL, default="200ms"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(max=cv.TimePeriod(milliseconds=2000)),
+            ),
+            cv.Optional(CONF_DMA_DESC_NUM, default=6): cv.int_range(min=2, max=32),
+            # A DMA buffer holds at most 4092 bytes, 1023 stereo 16-bit samples
+            cv.Optional(CONF_DMA_FRAME_NUM, default=480): cv.int_range(min=64, max=1023),
+            cv.Optional(CONF_LAZY_DECODE, default=False): cv.boolean,
         }
     )
     .extend(cv.COMPONENT_SCHEMA),
@@ -59,7 +73,14 @@ async def to_code(config):
     await register_i2s_audio_component(var, config)
 
     cg.add(var.set_dout_pin(config[CONF_I2S_DOUT_PIN]))
-    cg.add(var.set_buffer_frames(config[CONF_BUFFER_FRAMES]))
+    buffer_frames = config[CONF_BUFFER_FRAMES]
+    if buffer_frames == BUFFER_FRAMES_AUTO:
+        buffer_frames = 0
+    cg.add(var.set_buffer_frames(buffer_frames))
+    cg.add(var.set_pre_roll(int(config[CONF_PRE_ROLL].total_milliseconds)))
+    cg.add(var.set_dma_desc_num(config[CONF_DMA_DESC_NUM]))
+    cg.add(var.set_dma_frame_num(config[CONF_DMA_FRAME_NUM]))
+    cg.add(var.set_lazy_decode(config[CONF_LAZY_DECODE]))
 
     # Link the precompiled ALAC library
     cg.add_build_flag("-L${PROJECT_DIR}/src/esphome/components/raop_media_player/media_player/codecs/alac")
@@ -1,168 +1,643 @@
 #include "audio_buffer.h"
+#include "resampler.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include <string.h>
+#include <atomic>
 
 static const char *TAG = "audio_buffer";
-static audio_output_write_cb_t output_write_callback = NULL;
 
-#define BUFFER_FRAMES 1024
+#define AUTO_MIN_FRAMES 512
+#define AUTO_MAX_FRAMES 2048
+#define AUTO_PSRAM_RESERVE (256 * 1024)  // left free for the rest of the firmware
 #define MAX_FRAME_SIZE 2048
+#define FRAME_BYTES 1408        // 352 samples * 4 bytes, what ALAC frames decode to
+#define SAMPLE_RATE 44100
+#define FRAME_SAMPLES 352
 #define TIMING_THRESHOLD_MS 50  // Max drift before correction
-
+#define START_SLACK_US 16000    // below this, the start is trimmed to the sample instead of slept on
+
+// Stage room for a batch of up to BATCH_BYTES (any single frame fits), with
+// the per-call rounding of the resampler for each frame
+#define BATCH_BYTES(frames) ((frames) * FRAME_BYTES)
+#define STAGE_FRAMES(frames) \
+    (RESAMPLER_MAX_OUTPUT((BATCH_BYTES(frames) > MAX_FRAME_SIZE ? BATCH_BYTES(frames) : MAX_FRAME_SIZE) / 4) + 2 * (frames))
+
+// Frames are stored back to back in a contiguous byte ring and described by a
+// small FIFO of descriptors, so a slot costs what the frame needs instead of
+// MAX_FRAME_SIZE. A frame never straddles the end of the ring: when it does not
+// fit, the tail is left as padding and the frame starts again at offset 0.
 typedef struct {
-    uint8_t data[MAX_FRAME_SIZE];
-    size_t len;
-    uint32_t playtime;
-    bool ready;
+    uint32_t offset;    // position of the PCM data in the byte ring
+    uint32_t end;       // free-running byte count once this frame is released
+    int64_t playtime;   // esp_timer us
+    uint16_t len;
+    uint16_t generation;  // flush epoch the frame was written in
 } audio_frame_t;
 
-static struct {
+// Output start policy: wait for the pre-roll watermark (or the head frame's
+// playtime), align the first sample to its playtime, then play
+typedef enum { OUTPUT_PREROLL, OUTPUT_ALIGN, OUTPUT_PLAYING } output_state_t;
+
+// Single-producer (RTP thread) / single-consumer (output task) ring.
+// write_idx/write_bytes are only stored by the producer, read_idx/read_bytes
+// only by the consumer, so a frame is owned by exactly one side at any time and
+// no lock is needed. Flush comes from a third thread: it only bumps the
+// generation, and the consumer lazily discards frames stamped with an older one.
+struct audio_buffer_s {
     audio_frame_t *frames;
-    uint32_t read_idx;
-    uint32_t write_idx;
-    SemaphoreHandle_t mutex;
-    TaskHandle_t task;
-    bool running;
-} audio_buf = {0};
-
-static struct {
-    uint32_t skip_frames;
-    uint32_t pause_frames;
-} timing_correction = {0, 0};
+    uint32_t capacity;      // number of descriptors
+    uint8_t *data;
+    uint32_t data_size;
+    uint32_t write_offset;  // producer only
+    std::atomic<uint32_t> read_idx;
+    std::atomic<uint32_t> write_idx;
+    std::atomic<uint32_t> read_bytes;
+    std::atomic<uint32_t> write_bytes;
+    std::atomic<uint32_t> generation;
+    uint16_t write_generation;  // producer only, last generation written
+    std::atomic<uint32_t> flush_time_us;  // low 32 bits of esp_timer at last flush
+    TaskHandle_t task, joiner;
+    std::atomic<bool> running;
+
+    audio_buffer_write_cb_t write_cb;
+    void *write_ctx;
+
+    // Ring bytes (padding and descriptor included) and samples actually
+    // written, producer only. Not reset by init, so that the PSRAM cost of a
+    // buffered second is known between streams; halved together before the
+    // byte count overflows, which keeps their ratio.
+    struct {
+        std::atomic<uint32_t> bytes;
+        std::atomic<uint32_t> samples;
+    } usage;
+
+    struct {
+        std::atomic<uint32_t> skip_frames;
+        std::atomic<uint32_t> pause_frames;
+    } correction;
+
+    // Output stage state, consumer only except where atomic
+    struct {
+        uint32_t latency_samples;   // delay of a write into an idle output (one DMA buffer)
+        output_state_t state;
+        uint32_t preroll_ms;        // audio to buffer before (re)starting
+        std::atomic<uint32_t> prerolls;
+        std::atomic<uint32_t> underruns;
+        uint16_t generation;        // flush epoch the output state belongs to
+        // Last aligned start: sample index of its first sample and the low 32
+        // bits of the esp_timer time it is due, until I2S reports it sent
+        std::atomic<bool> start_pending;
+        std::atomic<uint32_t> start_sample;
+        std::atomic<uint32_t> start_target;
+        std::atomic<int32_t> start_error_us;
+        std::atomic<int32_t> rate_ppm;  // requested by the sync loop
+        int32_t applied_ppm;
+        bool resampling;            // engaged on first non-zero rate, until next flush
+        resampler_t resampler;
+        int16_t last_sample[2];     // last stereo sample written, before volume
+        // Samples handed to the output vs. samples the I2S DMA reported as sent.
+        // The difference is what sits between us and the DAC.
+        std::atomic<uint32_t> samples_written;
+        std::atomic<uint32_t> samples_sent;
+        // Sample index at which the last frame started, and its sender playtime.
+        // Written by the output task, read by the sync loop under a sequence lock.
+        std::atomic<uint32_t> anchor_seq;
+        uint32_t anchor_samples;
+        int64_t anchor_playtime;
+    } output;
+
+    // Frames coalesced into one output write, and the resampler output for
+    // such a batch (internal RAM since I2S reads it right away)
+    uint32_t batch_frames;
+    int16_t *stage;
+
+    // Writable because the output stage scales samples in place (zero stays zero)
+    uint8_t silence[FRAME_BYTES];
+};
+
+// Backs the audio_buffer_* functions. Static so that the I2S ISR can never
+// see it freed; only its ring is allocated and released.
+static struct audio_buffer_s default_ab;
+static audio_output_write_cb_t default_write_cb = NULL;
 
 static uint32_t gettime_ms(void) {
     return (uint32_t)(esp_timer_get_time() / 1000ULL);
 }
 
+// Wake the output task: it blocks on its notification whenever it has nothing to do
+static void wake_output_task(audio_buffer_t *ab) {
+    if (ab->task) {
+        xTaskNotifyGive(ab->task);
+    }
+}
+
+// Consumer side: a flush happened, the next frame starts a new timeline
+static void consume_flush(audio_buffer_t *ab) {
+    uint16_t generation = (uint16_t)ab->generation.load(std::memory_order_acquire);
+    if (generation != ab->output.generation) {
+        ab->output.generation = generation;
+        ab->output.state = OUTPUT_PREROLL;
+        ab->output.resampling = false;
+    }
+}
+
+// Consumer side: borrow the head frame in place. The memory stays ours (and
+// may be modified, e.g. for volume) until the frame is committed.
+static uint8_t *borrow_frame(audio_buffer_t *ab, uint32_t read_idx, size_t *len) {
+    audio_frame_t *frame = &ab->frames[read_idx];
+    *len = frame->len;
+    return ab->data + frame->offset;
+}
+
+// Consumer side: hand the head frame's bytes back to the producer
+static void commit_frame(audio_buffer_t *ab, uint32_t read_idx) {
+    ab->read_bytes.store(ab->frames[read_idx].end, std::memory_order_release);
+    ab->read_idx.store((read_idx + 1) % ab->capacity, std::memory_order_release);
+}
+
+// Every sample going to the output is counted before the (blocking) write, so
+// samples_written - samples_sent also covers a write still in progress
+static void output_write(audio_buffer_t *ab, uint8_t *data, size_t len) {
+    if (len >= 4) {
+        memcpy(ab->output.last_sample, data + (len / 4 - 1) * 4, sizeof(ab->output.last_sample));
+    }
+    ab->output.samples_written.fetch_add(len / 4, std::memory_order_release);
+    ab->write_cb(ab->write_ctx, data, len);
+}
+
+static uint32_t output_pending(audio_buffer_t *ab) {
+    uint32_t sent = ab->output.samples_sent.load(std::memory_order_acquire);
+    return ab->output.samples_written.load(std::memory_order_acquire) - sent;
+}
+
+static void set_anchor(audio_buffer_t *ab, int64_t playtime) {
+    ab->output.anchor_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    ab->output.anchor_samples = ab->output.samples_written.load(std::memory_order_relaxed);
+    ab->output.anchor_playtime = playtime;
+    ab->output.anchor_seq.fetch_add(1, std::memory_order_release);
+}
+
+static void write_silence(audio_buffer_t *ab, size_t len) {
+    while (len > 0 && ab->write_cb) {
+        size_t chunk = len < sizeof(ab->silence) ? len : sizeof(ab->silence);
+        output_write(ab, ab->silence, chunk);
+        len -= chunk;
+    }
+}
+
+// Extend a write from read_idx over the ready frames that directly follow it
+// in the byte ring (same flush epoch, no wrap), up to the batch size. Returns
+// the number of frames in the run.
+static uint32_t gather_frames(audio_buffer_t *ab, uint32_t read_idx, uint32_t write_idx) {
+    const audio_frame_t *first = &ab->frames[read_idx];
+    uint32_t idx = (read_idx + 1) % ab->capacity;
+    uint32_t count = 1;
+    size_t total = first->len;
+
+    while (count < ab->batch_frames && idx != write_idx) {
+        const audio_frame_t *next = &ab->frames[idx];
+        if (next->generation != first->generation || next->offset != first->offset + total ||
+            total + next->len > BATCH_BYTES(ab->batch_frames)) {
+            break;
+        }
+        total += next->len;
+        count++;
+        idx = (idx + 1) % ab->capacity;
+    }
+
+    return count;
+}
+
+// Audio frames go through the resampler once drift correction is active. It
+// stays engaged until the next flush so its history never has gaps. A batch
+// is resampled frame by frame into the stage and written out in one call.
+static void output_frames(audio_buffer_t *ab, uint32_t read_idx, uint32_t count, size_t skip) {
+    int32_t ppm = ab->output.rate_ppm.load(std::memory_order_relaxed);
+    size_t len;
+    uint8_t *data = borrow_frame(ab, read_idx, &len);
+
+    if (!ab->output.resampling && ppm != 0) {
+        // Carry on from what was just played, not from silence
+        resampler_init(&ab->output.resampler, ab->output.last_sample);
+        ab->output.applied_ppm = 0;
+        ab->output.resampling = true;
+    }
+
+    if (!ab->output.resampling) {
+        // The run is contiguous in the ring, hand it over as is
+        for (uint32_t i = 1; i < count; i++) {
+            len += ab->frames[(read_idx + i) % ab->capacity].len;
+        }
+        output_write(ab, data + skip, len - skip);
+        return;
+    }
+
+    if (ppm != ab->output.applied_ppm) {
+        resampler_set_ppm(&ab->output.resampler, ppm);
+        ab->output.applied_ppm = ppm;
+    }
+
+    size_t frames = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0) {
+            data = borrow_frame(ab, (read_idx + i) % ab->capacity, &len);
+        }
+        frames += resampler_process(&ab->output.resampler, (const int16_t *)(data + skip), (len - skip) / 4,
+                                    ab->stage + frames * 2);
+        skip = 0;
+    }
+    output_write(ab, (uint8_t *)ab->stage, frames * 4);
+}
+
+static uint32_t frames_queued(audio_buffer_t *ab) {
+    uint32_t write_idx = ab->write_idx.load(std::memory_order_acquire);
+    uint32_t read_idx = ab->read_idx.load(std::memory_order_acquire);
+    return (write_idx + ab->capacity - read_idx) % ab->capacity;
+}
+
+// Time until the frame's first sample must be handed to the output: its
+// playtime minus the output delay (what is still queued in I2S DMA plus one
+// DMA buffer). Negative when already late.
+static int64_t start_delay_us(audio_buffer_t *ab, const audio_frame_t *frame) {
+    int64_t latency_us = ((int64_t)(output_pending(ab) + ab->output.latency_samples) * 1000000) / SAMPLE_RATE;
+    int64_t now = esp_timer_get_time();
+    return frame->playtime - now - latency_us;
+}
+
+// Pre-roll: after init, flush or an underrun, hold output until preroll_ms of
+// audio is buffered or the head frame is due, whichever comes first, so a
+// trickling network does not feed the DMA frame by frame.
+static bool preroll_ready(audio_buffer_t *ab, uint32_t read_idx) {
+    uint32_t buffered_ms = frames_queued(ab) * FRAME_SAMPLES * 1000 / SAMPLE_RATE;
+    int64_t delay_us = start_delay_us(ab, &ab->frames[read_idx]);
+
+    if (buffered_ms >= ab->output.preroll_ms || delay_us <= START_SLACK_US) {
+        ESP_LOGD(TAG, "Pre-roll done with %u ms buffered", buffered_ms);
+        return true;
+    }
+
+    // Every write wakes us to re-check the watermark
+    TickType_t ticks = pdMS_TO_TICKS((delay_us - START_SLACK_US) / 1000);
+    ulTaskNotifyTake(pdTRUE, ticks ? ticks : 1);
+    return false;
+}
+
+// Playtime-gated start: the first frame after pre-roll is held until it is
+// due, then padded with silence or trimmed to the sample so that its first
+// sample reaches the DAC on time. Returns false when the frame must not be
+// played yet (or was dropped) and the loop should re-run.
+static bool schedule_start(audio_buffer_t *ab, uint32_t read_idx, size_t *skip) {
+    audio_frame_t *frame = &ab->frames[read_idx];
+    int64_t delay_us = start_delay_us(ab, frame);
+
+    if (delay_us > START_SLACK_US) {
+        // Too early: sleep, but let a flush, a write or deinit re-evaluate
+        TickType_t ticks = pdMS_TO_TICKS((delay_us - START_SLACK_US) / 1000);
+        ulTaskNotifyTake(pdTRUE, ticks ? ticks : 1);
+        return false;
+    }
+
+    int32_t offset = (int32_t)((delay_us * SAMPLE_RATE) / 1000000);
+
+    if (offset < 0 && (size_t)-offset * 4 >= frame->len) {
+        // Whole frame is already late, try the next one
+        ESP_LOGD(TAG, "Dropping late start frame (%lld us)", (long long)-delay_us);
+        commit_frame(ab, read_idx);
+        return false;
+    }
+
+    // The start error is measured by ab_output_sent() once I2S has sent the
+    // first sample played, against the playtime of that sample
+    uint32_t start_sample = ab->output.samples_written.load(std::memory_order_relaxed);
+    int64_t target = frame->playtime;
+    ab->output.start_pending.store(false, std::memory_order_relaxed);
+
+    if (offset > 0) {
+        write_silence(ab, (size_t)offset * 4);
+        start_sample += offset;
+        *skip = 0;
+    } else {
+        *skip = (size_t)-offset * 4;
+        target += ((int64_t)-offset * 1000000) / SAMPLE_RATE;
+    }
+
+    ab->output.start_sample.store(start_sample, std::memory_order_relaxed);
+    ab->output.start_target.store((uint32_t)target, std::memory_order_relaxed);
+    ab->output.start_pending.store(true, std::memory_order_release);
+    ab->output.state = OUTPUT_PLAYING;
+
+    ESP_LOGI(TAG, "Playback aligned to playtime %lld: %s %d samples", frame->playtime,
+             offset > 0 ? "padded" : "trimmed", offset > 0 ? offset : -offset);
+    return true;
+}
+
 static void audio_output_task(void *arg) {
-    ESP_LOGI(TAG, "Audio output task started");
+    audio_buffer_t *ab = (audio_buffer_t *)arg;
 
-    while (audio_buf.running) {
-        // Handle skip frames
-        if (timing_correction.skip_frames > 0) {
-            xSemaphoreTake(audio_buf.mutex, portMAX_DELAY);
+    ESP_LOGI(TAG, "[%p]: Audio output task started", ab);
+
+    while (ab->running.load(std::memory_order_relaxed)) {
+        consume_flush(ab);
 
-            while (timing_correction.skip_frames > 0 && audio_buf.read_idx != audio_buf.write_idx) {
-                audio_buf.frames[audio_buf.read_idx].ready = false;
-                audio_buf.read_idx = (audio_buf.read_idx + 1) % BUFFER_FRAMES;
-                timing_correction.skip_frames--;
+        uint32_t read_idx = ab->read_idx.load(std::memory_order_relaxed);
+        uint32_t write_idx = ab->write_idx.load(std::memory_order_acquire);
+
+        // Handle skip frames
+        if (ab->correction.skip_frames.load(std::memory_order_relaxed) > 0) {
+            while (ab->correction.skip_frames.load(std::memory_order_relaxed) > 0 && read_idx != write_idx) {
+                commit_frame(ab, read_idx);
+                read_idx = (read_idx + 1) % ab->capacity;
+                ab->correction.skip_frames.fetch_sub(1, std::memory_order_relaxed);
             }
 
-            xSemaphoreGive(audio_buf.mutex);
+            if (read_idx == write_idx) ab->correction.skip_frames.store(0, std::memory_order_relaxed);
+            ab->output.resampling = false;
             continue;
         }
 
         // Handle pause frames (insert silence)
-        if (timing_correction.pause_frames > 0) {
-            uint8_t silence[MAX_FRAME_SIZE];
-            memset(silence, 0, 1408); // 352 samples * 4 bytes
-            if (output_write_callback) {
-                output_write_callback(silence, 1408);
-            }
-            timing_correction.pause_frames--;
+        if (ab->correction.pause_frames.load(std::memory_order_relaxed) > 0) {
+            write_silence(ab, FRAME_BYTES);
+            ab->output.resampling = false;
+            ab->correction.pause_frames.fetch_sub(1, std::memory_order_relaxed);
             continue;
         }
 
-        // Normal playback
-        audio_frame_t *frame = NULL;
+        // Normal playback: hand the ring memory itself to the output, no copy
+        if (read_idx != write_idx) {
+            size_t skip = 0;
+
+            // Frames from before the last flush are dropped as we reach them.
+            // One of the current generation means a flush came in after
+            // consume_flush() above: catch up with it and look again.
+            uint16_t generation = ab->frames[read_idx].generation;
+            if (generation != ab->output.generation) {
+                if (generation != (uint16_t)ab->generation.load(std::memory_order_acquire)) {
+                    commit_frame(ab, read_idx);
+                }
+                continue;
+            }
 
-        xSemaphoreTake(audio_buf.mutex, portMAX_DELAY);
-        if (audio_buf.read_idx != audio_buf.write_idx) {
-            frame = &audio_buf.frames[audio_buf.read_idx];
-            if (frame->ready) {
-                uint8_t data[MAX_FRAME_SIZE];
-                memcpy(data, frame->data, frame->len);
-                size_t len = frame->len;
+            if (ab->output.state == OUTPUT_PREROLL) {
+                if (!preroll_ready(ab, read_idx)) {
+                    continue;
+                }
+                ab->output.prerolls.fetch_add(1, std::memory_order_relaxed);
+                ab->output.state = OUTPUT_ALIGN;
+            }
 
-                frame->ready = false;
-                audio_buf.read_idx = (audio_buf.read_idx + 1) % BUFFER_FRAMES;
+            if (ab->output.state == OUTPUT_ALIGN && !schedule_start(ab, read_idx, &skip)) {
+                continue;
+            }
 
-                xSemaphoreGive(audio_buf.mutex);
+            // Coalesce what is already queued into one write; a trimmed
+            // start frame goes out on its own
+            uint32_t count = skip ? 1 : gather_frames(ab, read_idx, write_idx);
 
-                if (output_write_callback) {
-                    output_write_callback(data, len);
-                }
-            } else {
-                xSemaphoreGive(audio_buf.mutex);
-                vTaskDelay(pdMS_TO_TICKS(10));
+            if (ab->write_cb) {
+                set_anchor(ab, ab->frames[read_idx].playtime + (int64_t)(skip / 4) * 1000000 / SAMPLE_RATE);
+                output_frames(ab, read_idx, count, skip);
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                commit_frame(ab, (read_idx + i) % ab->capacity);
             }
         } else {
-            xSemaphoreGive(audio_buf.mutex);
-            vTaskDelay(pdMS_TO_TICKS(10));
+            // Nothing to play: sleep until a write, flush, correction or deinit wakes us
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            // If the DMA ran dry meanwhile, restart through pre-roll rather
+            // than feeding frames one by one as they trickle in
+            if (ab->output.state == OUTPUT_PLAYING && output_pending(ab) == 0) {
+                ab->output.underruns.fetch_add(1, std::memory_order_relaxed);
+                ab->output.state = OUTPUT_PREROLL;
+                ab->output.resampling = false;
+                ESP_LOGW(TAG, "[%p]: Output underrun, re-entering pre-roll", ab);
+            }
         }
     }
 
+    ESP_LOGI(TAG, "[%p]: Audio output task stopped", ab);
+    xTaskNotifyGive(ab->joiner);
     vTaskDelete(NULL);
 }
 
-void audio_buffer_init(audio_output_write_cb_t write_cb) {
-    // Clean up if already initialized
-    if (audio_buf.running) {
-        audio_buffer_deinit();
-    }
+// Size the ring from the PSRAM left once the session has set up its other
+// buffers, keeping a reserve for everything else
+static uint32_t auto_capacity(void) {
+    size_t free_block = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    size_t usable = free_block > AUTO_PSRAM_RESERVE ? free_block - AUTO_PSRAM_RESERVE : 0;
+    uint32_t frames = usable / (sizeof(audio_frame_t) + FRAME_BYTES);
 
-    output_write_callback = write_cb;
+    if (frames < AUTO_MIN_FRAMES) frames = AUTO_MIN_FRAMES;
+    if (frames > AUTO_MAX_FRAMES) frames = AUTO_MAX_FRAMES;
 
-    memset(&audio_buf, 0, sizeof(audio_buf));
+    ESP_LOGI(TAG, "Auto sizing from %zu bytes of free PSRAM: %u frames", free_block, frames);
+    return frames;
+}
 
-    // Allocate frame buffer in PSRAM
-    audio_buf.frames = (audio_frame_t *)heap_caps_malloc(BUFFER_FRAMES * sizeof(audio_frame_t),
-                                                      MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    if (!audio_buf.frames) {
+// Bring an instance to a clean state, allocate its ring and start its task
+static bool ab_setup(audio_buffer_t *ab, const audio_buffer_config_t *config) {
+    ab->write_cb = config->write_cb;
+    ab->write_ctx = config->write_ctx;
+
+    ab->read_idx = 0;
+    ab->write_idx = 0;
+    ab->read_bytes = 0;
+    ab->write_bytes = 0;
+    ab->write_offset = 0;
+    ab->generation = 0;
+    ab->write_generation = 0;
+    ab->flush_time_us = 0;
+    ab->task = NULL;
+    ab->joiner = NULL;
+    ab->output.latency_samples = config->output_latency;
+    ab->output.preroll_ms = config->preroll_ms;
+    ab->output.state = OUTPUT_PREROLL;
+    ab->output.prerolls = 0;
+    ab->output.underruns = 0;
+    ab->output.generation = 0;
+    ab->output.start_pending = false;
+    ab->output.start_error_us = 0;
+    ab->output.rate_ppm = 0;
+    ab->output.resampling = false;
+    memset(ab->output.last_sample, 0, sizeof(ab->output.last_sample));
+    ab->output.samples_written = 0;
+    ab->output.samples_sent = 0;
+    ab->output.anchor_seq = 0;
+    ab->output.anchor_samples = 0;
+    ab->output.anchor_playtime = 0;
+    ab->correction.skip_frames = 0;
+    ab->correction.pause_frames = 0;
+    memset(ab->silence, 0, sizeof(ab->silence));
+
+    // Allocate descriptors and byte ring in one PSRAM block
+    ab->capacity = config->capacity ? config->capacity : auto_capacity();
+    size_t desc_size = ab->capacity * sizeof(audio_frame_t);
+    ab->data_size = ab->capacity * FRAME_BYTES;
+    ab->frames = (audio_frame_t *)heap_caps_malloc(desc_size + ab->data_size,
+                                                   MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!ab->frames) {
         ESP_LOGE(TAG, "Failed to allocate frame buffer in PSRAM");
-        return;
+        return false;
     }
 
-    memset(audio_buf.frames, 0, BUFFER_FRAMES * sizeof(audio_frame_t));
+    memset(ab->frames, 0, desc_size);
+    ab->data = (uint8_t *)ab->frames + desc_size;
+
+    ab->batch_frames = config->batch_frames ? config->batch_frames : 1;
+    if (ab->batch_frames > AUDIO_BUFFER_MAX_BATCH) ab->batch_frames = AUDIO_BUFFER_MAX_BATCH;
+    ab->stage = (int16_t *)heap_caps_malloc(STAGE_FRAMES(ab->batch_frames) * 4, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!ab->stage) {
+        ESP_LOGE(TAG, "Failed to allocate output stage");
+        free(ab->frames);
+        ab->frames = NULL;
+        ab->data = NULL;
+        return false;
+    }
 
-    audio_buf.mutex = xSemaphoreCreateMutex();
-    audio_buf.running = true;
+    ab->running = true;
+
+    if (xTaskCreatePinnedToCore(
+            audio_output_task,
+            "audio_output",
+            4096,
+            ab,
+            config->task_priority,
+            &ab->task,
+            config->task_core
+        ) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create audio output task");
+        ab->running = false;
+        ab->task = NULL;
+        free(ab->stage);
+        ab->stage = NULL;
+        free(ab->frames);
+        ab->frames = NULL;
+        ab->data = NULL;
+        return false;
+    }
 
-    xTaskCreatePinnedToCore(
-        audio_output_task,
-        "audio_output",
-        4096,
-        NULL,
-        3,
-        &audio_buf.task,
-        1
-    );
+    ESP_LOGI(TAG, "[%p]: Audio buffer initialized: %u frames, %u ms headroom (%u bytes), %u frames per write",
+             ab, ab->capacity, ab->capacity * FRAME_SAMPLES * 1000 / SAMPLE_RATE,
+             (unsigned)(desc_size + ab->data_size), ab->batch_frames);
+    return true;
+}
 
-    ESP_LOGI(TAG, "Audio buffer initialized");
+// Stop the task and release the ring, the instance itself stays
+static void ab_teardown(audio_buffer_t *ab) {
+    if (ab->task) {
+      // Wake the task so it sees running == false, then wait for it to exit
+      ab->joiner = xTaskGetCurrentTaskHandle();
+      ab->running = false;
+      xTaskNotifyGive(ab->task);
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      ab->task = NULL;
+    }
+    ab->running = false;
+    if (ab->frames) {
+      free(ab->frames);
+      ab->frames = NULL;
+      ab->data = NULL;
+    }
+    if (ab->stage) {
+      free(ab->stage);
+      ab->stage = NULL;
+    }
 }
 
-bool audio_buffer_write(const uint8_t *data, size_t len, uint32_t playtime) {
+/*---------------------------------------------------------------------------*/
+audio_buffer_t *ab_create(const audio_buffer_config_t *config) {
+    // Holds the silence buffer, keep it in internal RAM
+    audio_buffer_t *ab = (audio_buffer_t *)heap_caps_calloc(1, sizeof(audio_buffer_t),
+                                                            MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!ab) {
+        ESP_LOGE(TAG, "Failed to allocate audio buffer");
+        return NULL;
+    }
+
+    if (!ab_setup(ab, config)) {
+        free(ab);
+        return NULL;
+    }
+
+    return ab;
+}
+
+void ab_destroy(audio_buffer_t *ab) {
+    if (!ab) return;
+    ab_teardown(ab);
+    free(ab);
+}
+
+static void account_usage(audio_buffer_t *ab, uint32_t bytes, uint32_t samples) {
+    bytes += ab->usage.bytes.load(std::memory_order_relaxed);
+    samples += ab->usage.samples.load(std::memory_order_relaxed);
+    if (bytes & 0x80000000u) {
+        bytes >>= 1;
+        samples >>= 1;
+    }
+    ab->usage.bytes.store(bytes, std::memory_order_relaxed);
+    ab->usage.samples.store(samples, std::memory_order_relaxed);
+}
+
+bool ab_write(audio_buffer_t *ab, const uint8_t *data, size_t len, int64_t playtime) {
     if (len > MAX_FRAME_SIZE) {
         ESP_LOGE(TAG, "Frame too large: %zu bytes", len);
         return false;
     }
 
-    // Try up to 5 times with 10ms delays between attempts
-    for (int retries = 0; retries < 5; retries++) {
-        xSemaphoreTake(audio_buf.mutex, portMAX_DELAY);
+    uint32_t write_idx = ab->write_idx.load(std::memory_order_relaxed);
+    uint32_t next_write = (write_idx + 1) % ab->capacity;
+    uint32_t write_bytes = ab->write_bytes.load(std::memory_order_relaxed);
+
+    // Keep frames 32-bit aligned; wrap to the start instead of splitting a frame
+    uint32_t size = (len + 3) & ~3u;
+    uint32_t offset = ab->write_offset;
+    uint32_t pad = 0;
+    if (offset + size > ab->data_size) {
+        pad = ab->data_size - offset;
+        offset = 0;
+    }
 
-        uint32_t next_write = (audio_buf.write_idx + 1) % BUFFER_FRAMES;
+    uint16_t generation = (uint16_t)ab->generation.load(std::memory_order_acquire);
+    if (generation != ab->write_generation) {
+        uint32_t elapsed = (uint32_t)esp_timer_get_time() - ab->flush_time_us.load(std::memory_order_relaxed);
+        ESP_LOGI(TAG, "[%p]: First frame %u us after flush", ab, elapsed);
+        ab->write_generation = generation;
+    }
 
-        // Check if buffer has space
-        if (next_write != audio_buf.read_idx) {
-            audio_frame_t *frame = &audio_buf.frames[audio_buf.write_idx];
-            memcpy(frame->data, data, len);
+    // Try up to 5 times with 10ms delays between attempts
+    for (int retries = 0; retries < 5; retries++) {
+        uint32_t used = write_bytes - ab->read_bytes.load(std::memory_order_acquire);
+
+        // Check if buffer has a free descriptor and enough bytes
+        if (next_write != ab->read_idx.load(std::memory_order_acquire) &&
+            used + pad + size <= ab->data_size) {
+            audio_frame_t *frame = &ab->frames[write_idx];
+            memcpy(ab->data + offset, data, len);
+            frame->offset = offset;
             frame->len = len;
+            frame->end = write_bytes + pad + size;
             frame->playtime = playtime;
-            frame->ready = true;
+            frame->generation = generation;
 
-            audio_buf.write_idx = next_write;
+            ab->write_offset = (offset + size) % ab->data_size;
+            ab->write_bytes.store(frame->end, std::memory_order_relaxed);
+            account_usage(ab, pad + size + sizeof(audio_frame_t), len / 4);
 
-            xSemaphoreGive(audio_buf.mutex);
+            // Publish the frame to the consumer
+            ab->write_idx.store(next_write, std::memory_order_release);
+            wake_output_task(ab);
             return true;
         }
 
-        xSemaphoreGive(audio_buf.mutex);
-
         // Buffer full, wait for I2S to drain
         if (retries < 4) {
             vTaskDelay(pdMS_TO_TICKS(10));
@@ -173,74 +648,234 @@ bool audio_buffer_write(const uint8_t *data, size_t len, uint32_t playtime) {
     return false;
 }
 
-void audio_buffer_flush(void) {
-    xSemaphoreTake(audio_buf.mutex, portMAX_DELAY);
+void ab_flush(audio_buffer_t *ab) {
+    // Constant time: frames written so far carry an older generation and are
+    // discarded by the consumer when it reaches them
+    ab->flush_time_us.store((uint32_t)esp_timer_get_time(), std::memory_order_relaxed);
+    ab->generation.fetch_add(1, std::memory_order_release);
+    ab->correction.skip_frames.store(0, std::memory_order_relaxed);
+    ab->correction.pause_frames.store(0, std::memory_order_relaxed);
+    ab->output.rate_ppm.store(0, std::memory_order_relaxed);
+    wake_output_task(ab);
+
+    ESP_LOGI(TAG, "[%p]: Buffer flushed", ab);
+}
+
+void ab_get_timing(audio_buffer_t *ab, uint32_t *frames_buffered, int64_t *head_playtime) {
 
-    // Mark all frames as not ready
-    for (int i = 0; i < BUFFER_FRAMES; i++) {
-        audio_buf.frames[i].ready = false;
+    if (!ab->frames) {
+        *frames_buffered = 0;
+        *head_playtime = 0;
+        return;
     }
 
-    audio_buf.read_idx = 0;
-    audio_buf.write_idx = 0;
+    uint32_t write_idx = ab->write_idx.load(std::memory_order_acquire);
+    uint32_t read_idx = ab->read_idx.load(std::memory_order_acquire);
 
-    xSemaphoreGive(audio_buf.mutex);
+    // Calculate how many frames are buffered
+    if (write_idx == read_idx) {
+        *frames_buffered = 0;
+    } else if (ab->frames[(write_idx == 0) ? ab->capacity - 1 : write_idx - 1].generation !=
+               (uint16_t)ab->generation.load(std::memory_order_acquire)) {
+        // Only frames from before the last flush, waiting to be discarded
+        *frames_buffered = 0;
+    } else if (write_idx >= read_idx) {
+        *frames_buffered = write_idx - read_idx;
+    } else {
+        *frames_buffered = ab->capacity - read_idx + write_idx;
+    }
 
-    ESP_LOGI(TAG, "Buffer flushed");
+    // Get the playtime of the most recent frame (stable: only the producer rewrites it)
+    if (*frames_buffered > 0) {
+        uint32_t head_idx = (write_idx == 0) ? ab->capacity - 1 : write_idx - 1;
+        *head_playtime = ab->frames[head_idx].playtime;
+    } else {
+        *head_playtime = 0;
+    }
 }
 
-void audio_buffer_deinit(void) {
-    audio_buf.running = false;
-    if (audio_buf.task) {
-      vTaskDelay(pdMS_TO_TICKS(100));
+void ab_skip_frames(audio_buffer_t *ab, uint32_t count) {
+    ab->correction.skip_frames.store(count, std::memory_order_relaxed);
+    wake_output_task(ab);
+    ESP_LOGI(TAG, "Will skip %u frames", count);
+}
+
+void ab_pause_frames(audio_buffer_t *ab, uint32_t count) {
+    ab->correction.pause_frames.store(count, std::memory_order_relaxed);
+    wake_output_task(ab);
+    ESP_LOGI(TAG, "Will pause %u frames", count);
+}
+
+void ab_set_rate_adjust(audio_buffer_t *ab, int32_t ppm) {
+    ab->output.rate_ppm.store(ppm, std::memory_order_relaxed);
+}
+
+bool ab_is_ready(audio_buffer_t *ab) {
+    return ab->frames != NULL && ab->running;
+}
+
+void IRAM_ATTR ab_output_sent(audio_buffer_t *ab, uint32_t samples) {
+    // The DMA keeps running (and reporting) on auto-cleared buffers when we
+    // have nothing queued, never count more than was written
+    uint32_t sent = ab->output.samples_sent.load(std::memory_order_relaxed);
+    uint32_t pending = ab->output.samples_written.load(std::memory_order_acquire) - sent;
+    sent += samples < pending ? samples : pending;
+    ab->output.samples_sent.store(sent, std::memory_order_release);
+
+    // The first sample of an aligned start is out: the event comes as its DMA
+    // buffer ends, what followed it in there has been playing since
+    if (ab->output.start_pending.load(std::memory_order_acquire)) {
+        uint32_t after = sent - ab->output.start_sample.load(std::memory_order_relaxed);
+        if ((int32_t)after > 0) {
+            uint32_t at = (uint32_t)esp_timer_get_time() - (uint32_t)(((uint64_t)after * 1000000) / SAMPLE_RATE);
+            ab->output.start_error_us.store((int32_t)(at - ab->output.start_target.load(std::memory_order_relaxed)),
+                                            std::memory_order_relaxed);
+            ab->output.start_pending.store(false, std::memory_order_relaxed);
+        }
     }
-    if (audio_buf.mutex) {
-      vSemaphoreDelete(audio_buf.mutex);
+}
+
+bool ab_get_presentation(audio_buffer_t *ab, int64_t *playtime, int64_t *present_us) {
+    uint32_t seq, anchor_samples;
+    int64_t anchor_playtime;
+
+    if (!ab_is_ready(ab)) {
+        return false;
     }
-    if (audio_buf.frames) {
-      free(audio_buf.frames);
-      audio_buf.frames = NULL;
+
+    do {
+        seq = ab->output.anchor_seq.load(std::memory_order_acquire);
+        anchor_samples = ab->output.anchor_samples;
+        anchor_playtime = ab->output.anchor_playtime;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != ab->output.anchor_seq.load(std::memory_order_relaxed));
+
+    if (seq == 0) {
+        return false;   // nothing played yet
     }
+
+    // Signed: the anchor sample may already have left the DAC
+    int64_t now = esp_timer_get_time();
+    int32_t ahead = (int32_t)(anchor_samples - ab->output.samples_sent.load(std::memory_order_acquire));
+
+    *playtime = anchor_playtime;
+    *present_us = now + ((int64_t)ahead * 1000000) / SAMPLE_RATE;
+    return true;
 }
 
-void audio_buffer_get_timing(uint32_t *frames_buffered, uint32_t *head_playtime) {
+void ab_set_output_latency(audio_buffer_t *ab, uint32_t samples) {
+    ab->output.latency_samples = samples;
+    ESP_LOGD(TAG, "Output latency set to %u samples", samples);
+}
 
-    if (!audio_buf.frames || !audio_buf.mutex) {
-        *frames_buffered = 0;
-        *head_playtime = 0;
-        return;
-    }
+void ab_set_preroll(audio_buffer_t *ab, uint32_t ms) {
+    ab->output.preroll_ms = ms;
+}
+
+void ab_get_stats(audio_buffer_t *ab, audio_buffer_stats_t *stats) {
+    stats->frames_buffered = ab_is_ready(ab) ? frames_queued(ab) : 0;
+    stats->prerolls = ab->output.prerolls.load(std::memory_order_relaxed);
+    stats->underruns = ab->output.underruns.load(std::memory_order_relaxed);
+    stats->start_error_us = ab->output.start_error_us.load(std::memory_order_relaxed);
+    stats->bytes_per_second = ab_bytes_per_second(ab);
+}
 
-    xSemaphoreTake(audio_buf.mutex, portMAX_DELAY);
+size_t ab_bytes_per_second(audio_buffer_t *ab) {
+    uint32_t samples = ab->usage.samples.load(std::memory_order_relaxed);
+    uint32_t bytes = ab->usage.bytes.load(std::memory_order_relaxed);
+    return samples ? (size_t)(((uint64_t)bytes * SAMPLE_RATE) / samples) : 0;
+}
 
-    // Calculate how many frames are buffered
-    if (audio_buf.write_idx >= audio_buf.read_idx) {
-        *frames_buffered = audio_buf.write_idx - audio_buf.read_idx;
-    } else {
-        *frames_buffered = BUFFER_FRAMES - audio_buf.read_idx + audio_buf.write_idx;
+/*---------------------------------------------------------------------------*/
+// Default instance shim, the single-pipeline API used by the media player
+
+static void default_write(void *ctx, uint8_t *data, size_t len) {
+    if (default_write_cb) {
+        default_write_cb(data, len);
     }
+}
 
-    // Get the playtime of the most recent frame
-    if (*frames_buffered > 0) {
-        uint32_t head_idx = (audio_buf.write_idx == 0) ? BUFFER_FRAMES - 1 : audio_buf.write_idx - 1;
-        *head_playtime = audio_buf.frames[head_idx].playtime;
-    } else {
-        *head_playtime = 0;
+bool audio_buffer_init(audio_output_write_cb_t write_cb, uint32_t capacity) {
+    // Whoever runs the default instance keeps it, a second pipeline is an
+    // instance of its own
+    if (default_ab.running) {
+        ESP_LOGE(TAG, "Default audio buffer already in use");
+        return false;
     }
 
-    xSemaphoreGive(audio_buf.mutex);
+    default_write_cb = write_cb;
+
+    // Settings made before init (latency, pre-roll) are kept
+    audio_buffer_config_t config = AUDIO_BUFFER_DEFAULT_CONFIG();
+    config.write_cb = default_write;
+    config.capacity = capacity;
+    config.output_latency = default_ab.output.latency_samples;
+    config.preroll_ms = default_ab.output.preroll_ms;
+    config.batch_frames = default_ab.batch_frames;
+    return ab_setup(&default_ab, &config);
+}
+
+bool audio_buffer_write(const uint8_t *data, size_t len, int64_t playtime) {
+    return ab_write(&default_ab, data, len, playtime);
+}
+
+void audio_buffer_flush(void) {
+    ab_flush(&default_ab);
+}
+
+void audio_buffer_deinit(void) {
+    ab_teardown(&default_ab);
+}
+
+void audio_buffer_get_timing(uint32_t *frames_buffered, int64_t *head_playtime) {
+    ab_get_timing(&default_ab, frames_buffered, head_playtime);
 }
 
 void audio_buffer_skip_frames(uint32_t count) {
-    timing_correction.skip_frames = count;
-    ESP_LOGI(TAG, "Will skip %u frames", count);
+    ab_skip_frames(&default_ab, count);
 }
 
 void audio_buffer_pause_frames(uint32_t count) {
-    timing_correction.pause_frames = count;
-    ESP_LOGI(TAG, "Will pause %u frames", count);
+    ab_pause_frames(&default_ab, count);
+}
+
+void audio_buffer_set_rate_adjust(int32_t ppm) {
+    ab_set_rate_adjust(&default_ab, ppm);
 }
 
 bool audio_buffer_is_ready(void) {
-    return audio_buf.frames != NULL && audio_buf.running;
-}
\ No newline at end of file
+    return ab_is_ready(&default_ab);
+}
+
+void IRAM_ATTR audio_buffer_output_sent(uint32_t samples) {
+    ab_output_sent(&default_ab, samples);
+}
+
+bool audio_buffer_get_presentation(int64_t *playtime, int64_t *present_us) {
+    return ab_get_presentation(&default_ab, playtime, present_us);
+}
+
+void audio_buffer_set_output_latency(uint32_t samples) {
+    ab_set_output_latency(&default_ab, samples);
+}
+
+int32_t audio_buffer_get_start_error(void) {
+    return default_ab.output.start_error_us.load(std::memory_order_relaxed);
+}
+
+void audio_buffer_set_preroll(uint32_t ms) {
+    ab_set_preroll(&default_ab, ms);
+}
+
+void audio_buffer_set_batch_frames(uint32_t frames) {
+    // Takes effect at the next init, the stage is sized from it
+    default_ab.batch_frames = frames;
+}
+
+size_t audio_buffer_bytes_per_second(void) {
+    return ab_bytes_per_second(&default_ab);
+}
+
+void audio_buffer_get_stats(audio_buffer_stats_t *stats) {
+    ab_get_stats(&default_ab, stats);
+}
@@ -4,14 +4,26 @@
 #include <stddef.h>
 #include <stdbool.h>
 
-// Callback for writing audio data
-typedef void (*audio_output_write_cb_t)(const uint8_t *data, size_t len);
+// Output diagnostics since the last init
+typedef struct {
+    uint32_t frames_buffered;
+    uint32_t prerolls;          // (re)starts through pre-roll
+    uint32_t underruns;         // times the I2S DMA ran dry while playing
+    int32_t start_error_us;     // of the last aligned start, see audio_buffer_get_start_error()
+    uint32_t bytes_per_second;  // see audio_buffer_bytes_per_second()
+} audio_buffer_stats_t;
 
-// Initialize the audio buffer with output callback
-void audio_buffer_init(audio_output_write_cb_t write_cb);
+// Callback for writing audio data. data points into the buffer itself and may
+// be modified in place (volume); it is only valid for the duration of the call.
+typedef void (*audio_output_write_cb_t)(uint8_t *data, size_t len);
 
-// Write audio data with timing information
-bool audio_buffer_write(const uint8_t *data, size_t len, uint32_t playtime);
+// Initialize the audio buffer with output callback, holding capacity frames.
+// A capacity of 0 sizes the buffer from the PSRAM free at that point. Fails
+// while the default instance is already initialized: deinit it first.
+bool audio_buffer_init(audio_output_write_cb_t write_cb, uint32_t capacity);
+
+// Write audio data with the local time (esp_timer us) its first sample is due
+bool audio_buffer_write(const uint8_t *data, size_t len, int64_t playtime);
 
 // Flush all buffered audio
 void audio_buffer_flush(void);
@@ -20,11 +32,95 @@ void audio_buffer_flush(void);
 void audio_buffer_deinit(void);
 
 // Get current buffer level for sync calculations
-void audio_buffer_get_timing(uint32_t *frames_buffered, uint32_t *head_playtime);
+void audio_buffer_get_timing(uint32_t *frames_buffered, int64_t *head_playtime);
 
-// Timing correction
+// Timing correction: whole frames for gross errors, resampling for drift.
+// Positive ppm plays faster than the nominal rate, negative slower.
 void audio_buffer_skip_frames(uint32_t count);
 void audio_buffer_pause_frames(uint32_t count);
+void audio_buffer_set_rate_adjust(int32_t ppm);
 
 // Initialization check
-bool audio_buffer_is_ready(void);
\ No newline at end of file
+bool audio_buffer_is_ready(void);
+
+// PSRAM cost of one second of buffered audio, padding and descriptors
+// included, measured on the frames written so far; 0 until the first write
+size_t audio_buffer_bytes_per_second(void);
+
+// Delay in samples of a write into an idle output (one I2S DMA buffer). What
+// is actually queued in DMA is tracked through audio_buffer_output_sent().
+void audio_buffer_set_output_latency(uint32_t samples);
+
+// Report samples clocked out by the output, from the I2S on_sent ISR
+void audio_buffer_output_sent(uint32_t samples);
+
+// Playtime of the last frame handed to the output and the time at which its
+// first sample really reaches the DAC, including what is queued in I2S DMA,
+// both esp_timer us. False until something has been played.
+bool audio_buffer_get_presentation(int64_t *playtime, int64_t *present_us);
+
+// Start error of the last aligned start in microseconds (positive = late):
+// when its first sample went out, from the on_sent report of the DMA buffer
+// holding it, against that sample's playtime. Until I2S has sent it, the
+// error of the start before (0 after init).
+int32_t audio_buffer_get_start_error(void);
+
+// Audio to buffer before starting or restarting after an underrun; playback
+// also starts when the first frame's playtime comes first
+void audio_buffer_set_preroll(uint32_t ms);
+
+// Ready frames coalesced into one output write (1 = frame by frame), up to
+// AUDIO_BUFFER_MAX_BATCH. Applies from the next audio_buffer_init().
+#define AUDIO_BUFFER_MAX_BATCH 8
+void audio_buffer_set_batch_frames(uint32_t frames);
+
+void audio_buffer_get_stats(audio_buffer_stats_t *stats);
+
+/*---------------------------------------------------------------------------*/
+// Instance API. The audio_buffer_* functions above drive one static default
+// instance; ab_* handles are independent pipelines, each with its own ring,
+// output task and output callback.
+typedef struct audio_buffer_s audio_buffer_t;
+
+typedef void (*audio_buffer_write_cb_t)(void *ctx, uint8_t *data, size_t len);
+
+typedef struct {
+    audio_buffer_write_cb_t write_cb;
+    void *write_ctx;
+    uint32_t capacity;          // frames, 0 = sized from free PSRAM
+    uint32_t preroll_ms;
+    uint32_t output_latency;    // samples, see audio_buffer_set_output_latency()
+    int task_core;
+    unsigned task_priority;
+    uint32_t batch_frames;      // see audio_buffer_set_batch_frames()
+} audio_buffer_config_t;
+
+#define AUDIO_BUFFER_DEFAULT_CONFIG() { \
+    .write_cb = NULL, \
+    .write_ctx = NULL, \
+    .capacity = 0, \
+    .preroll_ms = 200, \
+    .output_latency = 0, \
+    .task_core = 1, \
+    .task_priority = 3, \
+    .batch_frames = 1, \
+}
+
+// NULL if the ring or the task cannot be allocated
+audio_buffer_t *ab_create(const audio_buffer_config_t *config);
+void ab_destroy(audio_buffer_t *ab);
+
+bool ab_write(audio_buffer_t *ab, const uint8_t *data, size_t len, int64_t playtime);
+void ab_flush(audio_buffer_t *ab);
+void ab_get_timing(audio_buffer_t *ab, uint32_t *frames_buffered, int64_t *head_playtime);
+void ab_skip_frames(audio_buffer_t *ab, uint32_t count);
+void ab_pause_frames(audio_buffer_t *ab, uint32_t count);
+void ab_set_rate_adjust(audio_buffer_t *ab, int32_t ppm);
+bool ab_is_ready(audio_buffer_t *ab);
+void ab_set_output_latency(audio_buffer_t *ab, uint32_t samples);
+// ISR safe as long as the instance outlives the output driver
+void ab_output_sent(audio_buffer_t *ab, uint32_t samples);
+bool ab_get_presentation(audio_buffer_t *ab, int64_t *playtime, int64_t *present_us);
+void ab_set_preroll(audio_buffer_t *ab, uint32_t ms);
+void ab_get_stats(audio_buffer_t *ab, audio_buffer_stats_t *stats);
+size_t ab_bytes_per_second(audio_buffer_t *ab);
\ No newline at end of file
@@ -0,0 +1,45 @@
+/*
+ * RAOP payload decryption
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <string.h>
+#include "cipher.h"
+
+/*---------------------------------------------------------------------------*/
+void cipher_init(cipher_t *cipher, const uint8_t key[16], const uint8_t iv[16]) {
+	memcpy(cipher->iv, iv, sizeof(cipher->iv));
+#ifdef WIN32
+	AES_set_decrypt_key(key, 128, &cipher->key);
+#else
+	esp_aes_init(&cipher->aes);
+	esp_aes_setkey(&cipher->aes, key, 128);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void cipher_free(cipher_t *cipher) {
+#ifndef WIN32
+	esp_aes_free(&cipher->aes);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void cipher_decrypt(cipher_t *cipher, uint8_t *data, size_t len) {
+	unsigned char iv[16];
+	size_t aeslen = len & ~0xf;
+
+	if (!aeslen) return;
+
+	// CBC decryption reads each ciphertext block before it is overwritten, so
+	// output can be the input
+	memcpy(iv, cipher->iv, sizeof(iv));
+#ifdef WIN32
+	AES_cbc_encrypt(data, data, aeslen, &cipher->key, iv, AES_DECRYPT);
+#else
+	esp_aes_crypt_cbc(&cipher->aes, ESP_AES_DECRYPT, aeslen, iv, data, data);
+#endif
+}
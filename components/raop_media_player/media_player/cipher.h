@@ -0,0 +1,35 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef WIN32
+#include <openssl/aes.h>
+#else
+#include "aes/esp_aes.h"
+#endif
+
+/*
+ * AES-128-CBC decryption of RAOP audio payloads, in place. Every packet starts
+ * from the session IV and only its whole 16-byte blocks are encrypted, the
+ * tail is sent in clear and left untouched.
+ *
+ * On ESP32 this runs on the AES peripheral through the esp_aes driver, which
+ * switches to DMA by itself on chips that have it. Host builds use OpenSSL.
+ */
+typedef struct {
+#ifdef WIN32
+	AES_KEY key;
+#else
+	esp_aes_context aes;
+#endif
+	uint8_t iv[16];
+} cipher_t;
+
+void	cipher_init(cipher_t *cipher, const uint8_t key[16], const uint8_t iv[16]);
+void	cipher_free(cipher_t *cipher);
+void	cipher_decrypt(cipher_t *cipher, uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * RAOP sender clock recovery
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <string.h>
+#include "clock_sync.h"
+
+#define CLOCK_RTT_SLACK	2000		// µs above the best round trip still trusted
+#define CLOCK_FIT_MIN	4			// trusted samples needed to fit a rate
+#define CLOCK_FIT_SPAN	10000000	// µs they must span
+#define CLOCK_STEP		100000		// µs away from the model means the sender clock jumped
+#define CLOCK_SKEW_MAX	500e-6
+
+/*---------------------------------------------------------------------------*/
+void clock_sync_init(clock_sync_t *clock) {
+	memset(clock, 0, sizeof(clock_sync_t));
+}
+
+/*---------------------------------------------------------------------------*/
+static void clock_sync_fit(clock_sync_t *clock) {
+	int64_t sum_x = 0, sum_y = 0, first = 0, last = 0, base;
+	uint32_t limit;
+	int i, n = 0, best = 0;
+
+	clock->min_rtt = UINT32_MAX;
+	for (i = 0; i < clock->count; i++) {
+		if (clock->samples[i].rtt < clock->min_rtt) {
+			clock->min_rtt = clock->samples[i].rtt;
+			best = i;
+		}
+	}
+
+	// sums are taken relative to one sample to keep them small
+	limit = clock->min_rtt + CLOCK_RTT_SLACK;
+	base = clock->samples[best].offset;
+	for (i = 0; i < clock->count; i++) {
+		if (clock->samples[i].rtt > limit) continue;
+		if (!n || clock->samples[i].local < first) first = clock->samples[i].local;
+		if (!n || clock->samples[i].local > last) last = clock->samples[i].local;
+		sum_x += clock->samples[i].local - clock->samples[best].local;
+		sum_y += clock->samples[i].offset - base;
+		n++;
+	}
+
+	clock->ref = clock->samples[best].local + sum_x / n;
+	clock->offset = base + sum_y / n;
+	clock->valid = true;
+
+	// not enough history for a rate, keep the previous one
+	if (n < CLOCK_FIT_MIN || last - first < CLOCK_FIT_SPAN) return;
+
+	double sxx = 0, sxy = 0;
+	for (i = 0; i < clock->count; i++) {
+		if (clock->samples[i].rtt > limit) continue;
+		double x = (double) (clock->samples[i].local - clock->ref);
+		double y = (double) (clock->samples[i].offset - clock->offset);
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	clock->skew = sxy / sxx;
+	if (clock->skew > CLOCK_SKEW_MAX) clock->skew = CLOCK_SKEW_MAX;
+	else if (clock->skew < -CLOCK_SKEW_MAX) clock->skew = -CLOCK_SKEW_MAX;
+}
+
+/*---------------------------------------------------------------------------*/
+bool clock_sync_update(clock_sync_t *clock, int64_t local_send, int64_t local_recv, uint64_t remote_ntp) {
+	int64_t local = local_send + (local_recv - local_send) / 2;
+	int64_t offset = local - ntp_to_us(remote_ntp);
+	uint32_t rtt = (uint32_t) (local_recv - local_send);
+
+	if (local_recv < local_send) return false;
+
+	// sender restarted or stepped its clock, history is worthless
+	if (clock->valid) {
+		int64_t error = offset - clock->offset - (int64_t) (clock->skew * (local - clock->ref));
+		if (error > CLOCK_STEP || error < -CLOCK_STEP) clock_sync_init(clock);
+	}
+
+	clock->samples[clock->next].local = local;
+	clock->samples[clock->next].offset = offset;
+	clock->samples[clock->next].rtt = rtt;
+	clock->next = (clock->next + 1) % CLOCK_SAMPLES;
+	if (clock->count < CLOCK_SAMPLES) clock->count++;
+
+	clock_sync_fit(clock);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+int64_t clock_sync_to_local(const clock_sync_t *clock, uint64_t remote_ntp) {
+	int64_t remote = ntp_to_us(remote_ntp);
+	// first order is plenty, the skew is a few hundred ppm at most
+	int64_t local = remote + clock->offset;
+	return local + (int64_t) (clock->skew * (local - clock->ref));
+}
+
+/*---------------------------------------------------------------------------*/
+int32_t clock_sync_ppm(const clock_sync_t *clock) {
+	// the offset grows when the sender clock runs slower than ours
+	return (int32_t) (-clock->skew * 1e6);
+}
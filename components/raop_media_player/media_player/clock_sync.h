@@ -0,0 +1,44 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sender clock recovery from the NTP-like timing exchange. Each reply gives
+ * one (local, remote) pair whose error is bounded by half its round trip, so
+ * only replies close to the smallest recent round trip are trusted. A line
+ * fitted through those gives a smoothed offset and the relative rate of the
+ * two clocks, instead of stepping on every reply.
+ *
+ * All times are in microseconds, local ones on the esp_timer timeline.
+ */
+#define CLOCK_SAMPLES	64
+
+typedef struct {
+	struct {
+		int64_t local;		// midpoint of the exchange
+		int64_t offset;		// local - remote
+		uint32_t rtt;
+	} samples[CLOCK_SAMPLES];
+	int count, next;
+	// model: offset(local) = offset + skew * (local - ref)
+	int64_t ref, offset;
+	double skew;
+	uint32_t min_rtt;
+	bool valid;
+} clock_sync_t;
+
+void	clock_sync_init(clock_sync_t *clock);
+// feed one timing reply, returns false when it is rejected
+bool	clock_sync_update(clock_sync_t *clock, int64_t local_send, int64_t local_recv, uint64_t remote_ntp);
+// local time at which the sender clock reads remote_ntp
+int64_t	clock_sync_to_local(const clock_sync_t *clock, uint64_t remote_ntp);
+// sender clock rate against ours, positive when the sender runs fast
+int32_t	clock_sync_ppm(const clock_sync_t *clock);
+
+static inline int64_t ntp_to_us(uint64_t ntp) {
+	return (int64_t) (ntp >> 32) * 1000000 + (int64_t) (((ntp & 0xffffffff) * 1000000) >> 32);
+}
+
+#endif
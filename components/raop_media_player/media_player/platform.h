@@ -47,6 +47,7 @@ char *strlwr(char *str);
 
 // Time utilities
 uint32_t gettime_ms(void);
+uint64_t gettime_us(void);
 
 typedef struct ntp_s {
 	u32_t seconds;
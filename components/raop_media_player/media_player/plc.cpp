@@ -0,0 +1,186 @@
+/*
+ * Packet loss concealment
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "plc.h"
+
+// pitch periods searched, 100 Hz to 1.1 kHz at 44.1 kHz, over PLC_WINDOW
+// samples; the coarse pass runs on a 2:1 decimated mono mix
+#define PLC_PERIOD_MIN	40
+#define PLC_PERIOD_MAX	440
+#define PLC_WINDOW		256
+#define PLC_SEARCH		((PLC_WINDOW + PLC_PERIOD_MAX) / 2)
+#define PLC_FADE		128		// samples crossfaded back into received audio
+#define PLC_HOLD		1		// frames repeated at full level
+#define PLC_DECAY		2		// frames over which the repetition then fades out
+
+/*---------------------------------------------------------------------------*/
+bool plc_init(plc_t *plc, int frame_size) {
+	memset(plc, 0, sizeof(plc_t));
+	plc->frame_size = frame_size;
+	plc->history = (int16_t*) calloc(PLC_HISTORY * 2, sizeof(int16_t));
+	plc->pitch = (int16_t*) malloc(PLC_PERIOD_MAX * 2 * sizeof(int16_t));
+	plc->frame = (int16_t*) malloc(frame_size * 2 * sizeof(int16_t));
+	plc->mono = (int16_t*) malloc(PLC_SEARCH * sizeof(int16_t));
+	return plc->history && plc->pitch && plc->frame && plc->mono;
+}
+
+/*---------------------------------------------------------------------------*/
+void plc_free(plc_t *plc) {
+	free(plc->history);
+	free(plc->pitch);
+	free(plc->frame);
+	free(plc->mono);
+}
+
+/*---------------------------------------------------------------------------*/
+void plc_reset(plc_t *plc) {
+	memset(plc->history, 0, PLC_HISTORY * 2 * sizeof(int16_t));
+	plc->head = 0;
+	plc->lost = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// stereo sample i of the history, 0 being the oldest
+static inline const int16_t *plc_at(const plc_t *plc, int i) {
+	return plc->history + ((plc->head + i) & (PLC_HISTORY - 1)) * 2;
+}
+
+/*---------------------------------------------------------------------------*/
+// runs for every frame played, so it only copies the frame in, in two parts
+// when it wraps
+static void plc_append(plc_t *plc, const int16_t *pcm, int samples) {
+	int first;
+
+	if (samples > PLC_HISTORY) {
+		pcm += (samples - PLC_HISTORY) * 2;
+		samples = PLC_HISTORY;
+	}
+
+	first = samples < PLC_HISTORY - plc->head ? samples : PLC_HISTORY - plc->head;
+	memcpy(plc->history + plc->head * 2, pcm, first * 2 * sizeof(int16_t));
+	memcpy(plc->history, pcm + first * 2, (samples - first) * 2 * sizeof(int16_t));
+	plc->head = (plc->head + samples) & (PLC_HISTORY - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+// normalised cross-correlation between the last len samples of x and the len
+// before them by lag, as corr^2 / energy with corr > 0 (else -1)
+static int64_t plc_score(const int16_t *x, int end, int len, int lag) {
+	int64_t corr = 0, energy = 0;
+
+	for (int i = end - len; i < end; i++) {
+		corr += (int32_t) x[i] * x[i - lag];
+		energy += (int32_t) x[i - lag] * x[i - lag];
+	}
+
+	if (corr <= 0) return -1;
+	corr >>= 8;
+	return (corr * corr) / ((energy >> 16) + 1);
+}
+
+/*---------------------------------------------------------------------------*/
+static int plc_find_period(plc_t *plc) {
+	int64_t score, best_score = -1;
+	int lag, best = PLC_PERIOD_MIN / 2;
+
+	// mono mix decimated by 2, halving both the lags and the window
+	for (int i = 0; i < PLC_SEARCH; i++) {
+		const int16_t *a = plc_at(plc, PLC_HISTORY - (PLC_SEARCH - i) * 2);
+		const int16_t *b = plc_at(plc, PLC_HISTORY - (PLC_SEARCH - i) * 2 + 1);
+		plc->mono[i] = (a[0] + a[1] + b[0] + b[1]) >> 2;
+	}
+
+	for (lag = PLC_PERIOD_MIN / 2; lag <= PLC_PERIOD_MAX / 2; lag++) {
+		score = plc_score(plc->mono, PLC_SEARCH, PLC_WINDOW / 2, lag);
+		if (score > best_score) {
+			best_score = score;
+			best = lag;
+		}
+	}
+
+	// refine around it at full rate on the left channel
+	int period = best * 2;
+	best_score = -1;
+	for (lag = best * 2 - 1; lag <= best * 2 + 1; lag++) {
+		int64_t corr = 0;
+		for (int i = PLC_HISTORY - PLC_WINDOW; i < PLC_HISTORY; i++) corr += (int32_t) plc_at(plc, i)[0] * plc_at(plc, i - lag)[0];
+		if (corr > best_score) {
+			best_score = corr;
+			period = lag;
+		}
+	}
+
+	return period < PLC_PERIOD_MIN ? PLC_PERIOD_MIN : period > PLC_PERIOD_MAX ? PLC_PERIOD_MAX : period;
+}
+
+/*---------------------------------------------------------------------------*/
+// the last period of history, with its tail crossfaded into what preceded its
+// head so that looping over it does not click
+static void plc_start(plc_t *plc) {
+	int period = plc_find_period(plc), overlap = period / 4;
+	int start = PLC_HISTORY - period;
+
+	for (int i = 0; i < period; i++) memcpy(plc->pitch + i * 2, plc_at(plc, start + i), 2 * sizeof(int16_t));
+
+	for (int i = 0; i < overlap; i++) {
+		int32_t w = ((i + 1) << 15) / (overlap + 1);
+		int16_t *s = plc->pitch + (period - overlap + i) * 2;
+		const int16_t *before = plc_at(plc, start - overlap + i);
+		s[0] = (s[0] * (32768 - w) + before[0] * w) >> 15;
+		s[1] = (s[1] * (32768 - w) + before[1] * w) >> 15;
+	}
+
+	plc->period = period;
+	plc->pos = 0;
+	plc->gain = 32768;
+}
+
+/*---------------------------------------------------------------------------*/
+static void plc_synth(plc_t *plc, int16_t *out, int samples) {
+	int32_t step = plc->lost > PLC_HOLD ? 32768 / (PLC_DECAY * plc->frame_size) : 0;
+
+	for (int i = 0; i < samples; i++, out += 2) {
+		const int16_t *s = plc->pitch + plc->pos * 2;
+		out[0] = (s[0] * plc->gain) >> 15;
+		out[1] = (s[1] * plc->gain) >> 15;
+		if (++plc->pos == plc->period) plc->pos = 0;
+		plc->gain = plc->gain > step ? plc->gain - step : 0;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+const int16_t *plc_conceal(plc_t *plc) {
+	if (!plc->lost++) plc_start(plc);
+
+	if (plc->gain) plc_synth(plc, plc->frame, plc->frame_size);
+	else memset(plc->frame, 0, plc->frame_size * 2 * sizeof(int16_t));
+
+	plc_append(plc, plc->frame, plc->frame_size);
+	return plc->frame;
+}
+
+/*---------------------------------------------------------------------------*/
+void plc_received(plc_t *plc, int16_t *pcm, int samples) {
+	if (plc->lost) {
+		int16_t *fade = plc->frame;
+		int len = samples < PLC_FADE ? samples : PLC_FADE;
+
+		// carry on the repetition a little and fade from it to the real thing
+		if (len > plc->frame_size) len = plc->frame_size;
+		plc_synth(plc, fade, len);
+		for (int i = 0; i < len * 2; i++) {
+			int32_t w = ((i / 2 + 1) << 15) / (len + 1);
+			pcm[i] = (fade[i] * (32768 - w) + pcm[i] * w) >> 15;
+		}
+		plc->lost = 0;
+	}
+
+	plc_append(plc, pcm, samples);
+}
@@ -0,0 +1,39 @@
+#ifndef PLC_H
+#define PLC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Packet loss concealment for 16 bits stereo PCM, by waveform repetition in
+ * the spirit of G.711 appendix I. A missing frame is rebuilt by repeating the
+ * last pitch period of what was played, whose wrap point is crossfaded to stay
+ * continuous. Longer losses fade out, and the first frame received afterwards
+ * is crossfaded in from the repetition instead of starting on an edge.
+ *
+ * Lengths are in stereo samples, all arithmetic is fixed point.
+ */
+#define PLC_HISTORY		1024	// a power of two, the history is a ring
+
+typedef struct {
+	int16_t *history;		// last PLC_HISTORY samples played, oldest at head
+	int head;				// where the next sample played goes
+	int16_t *pitch;			// repeated period, built when a loss starts
+	int16_t *frame;			// concealed frame handed out
+	int16_t *mono;			// pitch search scratch
+	int frame_size;
+	int period, pos;
+	int lost;				// consecutive frames concealed so far
+	int32_t gain;			// Q15
+} plc_t;
+
+bool	plc_init(plc_t *plc, int frame_size);
+void	plc_free(plc_t *plc);
+// forget history, after a flush
+void	plc_reset(plc_t *plc);
+// frame about to be played, faded in place when it ends a loss
+void	plc_received(plc_t *plc, int16_t *pcm, int samples);
+// synthesise the next missing frame (frame_size samples)
+const int16_t *plc_conceal(plc_t *plc);
+
+#endif
@@ -434,16 +434,18 @@ static bool handle_rtsp(raop_ctx_t *ctx, int sock)
 		rtp_resp_t rtp = { 0 };
 		short unsigned tport = 0, cport = 0;
 		uint8_t *buffer = NULL;
-		size_t size = 0;
+		size_t size = 0, pcm_size = rtp_buffer_size(ctx->latency, ctx->rtsp.fmtp, false);
+		size_t lazy_size = rtp_buffer_size(ctx->latency, ctx->rtsp.fmtp, true);
+		bool lazy_decode = false;
 
 		// we are about to stream, do something if needed and optionally give buffers to play with
-		success = ctx->cmd_cb(RAOP_SETUP, &buffer, &size);
+		success = ctx->cmd_cb(RAOP_SETUP, &buffer, &size, &lazy_decode, pcm_size, lazy_size);
 
 		if ((p = strcasestr(buf, "timing_port")) != NULL) sscanf(p, "%*[^=]=%hu", &tport);
 		if ((p = strcasestr(buf, "control_port")) != NULL) sscanf(p, "%*[^=]=%hu", &cport);
 
 		rtp = rtp_init(ctx->peer, ctx->latency, ctx->rtsp.aeskey, ctx->rtsp.aesiv,
-					   ctx->rtsp.fmtp, cport, tport, buffer, size, ctx->cmd_cb, ctx->data_cb);
+					   ctx->rtsp.fmtp, cport, tport, buffer, size, lazy_decode, ctx->cmd_cb, ctx->data_cb);
 
 		ctx->rtp = rtp.ctx;
 
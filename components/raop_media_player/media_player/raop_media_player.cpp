@@ -10,6 +10,11 @@ namespace raop_media_player {
 
 static const char *const TAG = "raop_media_player";
 
+// Sync errors beyond this are corrected with whole frames, below it by resampling
+static const int32_t DRIFT_STEP_MS = 250;
+static const float DRIFT_GAIN_PPM_PER_MS = 10.0f;
+static const float DRIFT_MAX_PPM = 500.0f;
+
 // Global instance for C callbacks
 RAOPMediaPlayer *g_raop_instance = nullptr;
 
@@ -27,18 +32,24 @@ static bool raop_cmd_callback_wrapper(raop_event_t event, ...) {
   return result;
 }
 
-static void raop_data_callback_wrapper(const uint8_t *data, size_t len, uint32_t playtime) {
+static void raop_data_callback_wrapper(const uint8_t *data, size_t len, int64_t playtime) {
   if (g_raop_instance) {
     g_raop_instance->handle_raop_data(data, len, playtime);
   }
 }
 
-static void audio_output_callback_wrapper(const uint8_t *data, size_t len) {
+static void audio_output_callback_wrapper(uint8_t *data, size_t len) {
   if (g_raop_instance) {
     g_raop_instance->write_audio_data(data, len);
   }
 }
 
+// ISR: a DMA buffer has been clocked out to the DAC
+static bool IRAM_ATTR i2s_on_sent_callback(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
+  audio_buffer_output_sent(event->size / 4);
+  return false;
+}
+
 }  // extern "C"
 
 void RAOPMediaPlayer::setup() {
@@ -57,7 +68,20 @@ void RAOPMediaPlayer::loop() {
 void RAOPMediaPlayer::dump_config() {
   ESP_LOGCONFIG(TAG, "RAOP Media Player:");
   ESP_LOGCONFIG(TAG, "  I2S DOUT Pin: GPIO%d", this->dout_pin_);
-  ESP_LOGCONFIG(TAG, "  Buffer Frames: %d", this->buffer_frames_);
+  if (this->buffer_frames_ == 0) {
+    ESP_LOGCONFIG(TAG, "  Buffer Frames: auto");
+  } else {
+    ESP_LOGCONFIG(TAG, "  Buffer Frames: %d", this->buffer_frames_);
+  }
+  ESP_LOGCONFIG(TAG, "  Pre-roll: %u ms", this->pre_roll_ms_);
+  ESP_LOGCONFIG(TAG, "  DMA: %u buffers of %u samples", this->dma_desc_num_, this->dma_frame_num_);
+  ESP_LOGCONFIG(TAG, "  Lazy Decode: %s", YESNO(this->lazy_decode_));
+  size_t bytes_per_second = audio_buffer_bytes_per_second();
+  if (bytes_per_second) {
+    ESP_LOGCONFIG(TAG, "  Buffer Bytes/s: %zu", bytes_per_second);
+  } else {
+    ESP_LOGCONFIG(TAG, "  Buffer Bytes/s: not measured yet");
+  }
 }
 
 media_player::MediaPlayerTraits RAOPMediaPlayer::get_traits() {
@@ -186,6 +210,8 @@ void RAOPMediaPlayer::setup_i2s_tx_() {
 
   // Configure I2S TX channel
   i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(port, I2S_ROLE_MASTER);
+  chan_cfg.dma_desc_num = this->dma_desc_num_;
+  chan_cfg.dma_frame_num = this->dma_frame_num_;
 
   esp_err_t err = i2s_new_channel(&chan_cfg, &this->tx_handle_, nullptr);
   if (err != ESP_OK) {
@@ -213,6 +239,14 @@ void RAOPMediaPlayer::setup_i2s_tx_() {
     return;
   }
 
+  // Count samples actually sent so sync sees the real output latency
+  i2s_event_callbacks_t callbacks = {};
+  callbacks.on_sent = i2s_on_sent_callback;
+  err = i2s_channel_register_event_callback(this->tx_handle_, &callbacks, nullptr);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to register I2S sent callback: %s", esp_err_to_name(err));
+  }
+
   err = i2s_channel_enable(this->tx_handle_);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Failed to enable I2S channel: %s", esp_err_to_name(err));
@@ -221,6 +255,14 @@ void RAOPMediaPlayer::setup_i2s_tx_() {
     return;
   }
 
+  // A write into an idle channel waits for the DMA buffer being sent
+  audio_buffer_set_output_latency(chan_cfg.dma_frame_num);
+
+  // Hand frames over in writes of about half the DMA ring, so one write
+  // refills what has drained while the other half keeps playing
+  uint32_t batch = (chan_cfg.dma_desc_num * chan_cfg.dma_frame_num / 2) / 352;
+  audio_buffer_set_batch_frames(batch < 1 ? 1 : batch > AUDIO_BUFFER_MAX_BATCH ? AUDIO_BUFFER_MAX_BATCH : batch);
+
   ESP_LOGI(TAG, "I2S TX channel configured successfully");
 }
 
@@ -255,8 +297,14 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
       // Allocate RTP buffer in PSRAM
       uint8_t **buffer = va_arg(args, uint8_t **);
       size_t *size = va_arg(args, size_t *);
-
-      *size = 352 * 4 * 1024;  // ~1.4MB for RTP buffer
+      bool *lazy_decode = va_arg(args, bool *);
+      size_t pcm_size = va_arg(args, size_t);
+      size_t lazy_size = va_arg(args, size_t);
+
+      // What the jitter buffer takes for this session's latency, its slots
+      // decoded or the chunk pool compressed frames are kept in
+      *lazy_decode = this->lazy_decode_;
+      *size = this->lazy_decode_ ? lazy_size : pcm_size;
       *buffer = (uint8_t *)heap_caps_malloc(*size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
       if (*buffer == NULL) {
@@ -269,7 +317,20 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
       ESP_LOGI(TAG, "Allocated %zu byte RTP buffer in PSRAM", *size);
 
       // Initialize audio buffer with our callback
-      audio_buffer_init(audio_output_callback_wrapper);
+      audio_buffer_set_preroll(this->pre_roll_ms_);
+      if (!audio_buffer_init(audio_output_callback_wrapper, this->buffer_frames_)) {
+        ESP_LOGE(TAG, "Failed to initialize audio buffer!");
+        heap_caps_free(*buffer);
+        *buffer = NULL;
+        this->cleanup_i2s_tx_();
+        this->unlock_i2s_();
+        return false;
+      }
+      this->drift_error_ms_ = 0.0f;
+      {
+        LockGuard guard(this->network_stats_lock_);
+        this->network_stats_ = {};
+      }
 
       this->stream_active_ = true;
       this->state = media_player::MEDIA_PLAYER_STATE_PLAYING;
@@ -281,8 +342,22 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
       ESP_LOGI(TAG, "RAOP: Stream started");
       break;
 
-    case RAOP_STOP:
+    case RAOP_STOP: {
       ESP_LOGI(TAG, "RAOP: Stream stopped");
+      audio_buffer_stats_t stats = this->get_output_stats();
+      ESP_LOGI(TAG, "Output: %u pre-rolls, %u underruns, last start error %d us, %u bytes per buffered second",
+               stats.prerolls, stats.underruns, stats.start_error_us, stats.bytes_per_second);
+      raop_stats_t net = this->get_network_stats();
+      ESP_LOGI(TAG, "Network: %u of %u requested frames recovered, %u expired, RTT %u ms, sender clock %+d ppm",
+               net.frames_recovered, net.frames_requested, net.frames_expired, net.rtt_ms, (int) net.clock_skew_ppm);
+      ESP_LOGI(TAG, "Network: arrival to playtime %u ms mean, %d ms least", net.playout_us / 1000,
+               (int) (net.playout_min_us / 1000));
+      // bins as RAOP_HIST_EDGES, per mille of the latency: late, <250, <500, <750, <900, <950, <1000, more
+      ESP_LOGI(TAG, "Network: jitter %u us, lead %u/%u/%u/%u/%u/%u/%u/%u, depth %u/%u/%u/%u/%u/%u/%u/%u", net.jitter_us,
+               net.lead_hist[0], net.lead_hist[1], net.lead_hist[2], net.lead_hist[3], net.lead_hist[4],
+               net.lead_hist[5], net.lead_hist[6], net.lead_hist[7], net.depth_hist[0], net.depth_hist[1],
+               net.depth_hist[2], net.depth_hist[3], net.depth_hist[4], net.depth_hist[5], net.depth_hist[6],
+               net.depth_hist[7]);
       audio_buffer_flush();
       audio_buffer_deinit();
       this->cleanup_i2s_tx_();
@@ -291,10 +366,12 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
       this->state = media_player::MEDIA_PLAYER_STATE_IDLE;
       this->publish_state();
       break;
+    }
 
     case RAOP_FLUSH:
       ESP_LOGI(TAG, "RAOP: Flush requested");
       audio_buffer_flush();
+      this->drift_error_ms_ = 0.0f;
       break;
 
     case RAOP_VOLUME: {
@@ -306,33 +383,57 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
     }
 
     case RAOP_TIMING: {
+      // sender clock rate against ours, as recovered from the NTP exchange
+      int skew_ppm = va_arg(args, int);
       if (!audio_buffer_is_ready())
         break;
 
-      // Timing sync for multi-room
-      uint32_t frames_buffered, head_playtime;
-      audio_buffer_get_timing(&frames_buffered, &head_playtime);
-
-      if (frames_buffered == 0)
+      // Timing sync for multi-room: compare when the sender wants the last
+      // frame handed to I2S played with when it really reaches the DAC
+      int64_t playtime, present_us;
+      if (!audio_buffer_get_presentation(&playtime, &present_us))
         break;
 
-      uint32_t now = (uint32_t)(esp_timer_get_time() / 1000ULL);
-      uint32_t buffer_duration_ms = (frames_buffered * 352 * 1000) / 44100;
-      uint32_t local_head_time = now + buffer_duration_ms;
-      int32_t error = (int32_t)(head_playtime - local_head_time);
+      int64_t error_us = playtime - present_us;
+      int32_t error = (int32_t)(error_us / 1000);
 
-      ESP_LOGV(TAG, "Timing: buffered=%u frames, error=%d ms", frames_buffered, error);
+      ESP_LOGV(TAG, "Timing: playtime=%lld us, presented=%lld us, error=%lld us", playtime, present_us, error_us);
 
-      // Correct if drift > 50ms
-      if (error < -50) {
+      // Gross errors (stall, sender jump) are fixed at once with whole frames
+      if (error < -DRIFT_STEP_MS) {
         uint32_t skip = (-error * 44100) / (352 * 1000);
         audio_buffer_skip_frames(skip);
+        this->drift_error_ms_ = 0.0f;
         ESP_LOGD(TAG, "Skipping %u frames (ahead by %d ms)", skip, -error);
-      } else if (error > 50) {
+        break;
+      } else if (error > DRIFT_STEP_MS) {
         uint32_t pause = (error * 44100) / (352 * 1000);
         audio_buffer_pause_frames(pause);
+        this->drift_error_ms_ = 0.0f;
         ESP_LOGD(TAG, "Pausing %u frames (behind by %d ms)", pause, error);
+        break;
       }
+
+      // Clock skew is absorbed continuously by the resampler. The recovered
+      // sender rate is applied up front so the error loop only has to trim
+      // what is left. The DMA sent count moves in whole DMA buffers, so
+      // smooth before steering the rate.
+      this->drift_error_ms_ += 0.25f * ((float) error_us / 1000.0f - this->drift_error_ms_);
+      float ppm = (float) skew_ppm - this->drift_error_ms_ * DRIFT_GAIN_PPM_PER_MS;
+      if (ppm > DRIFT_MAX_PPM)
+        ppm = DRIFT_MAX_PPM;
+      else if (ppm < -DRIFT_MAX_PPM)
+        ppm = -DRIFT_MAX_PPM;
+      audio_buffer_set_rate_adjust((int32_t) ppm);
+      ESP_LOGV(TAG, "Drift: filtered error %.1f ms, sender skew %+d ppm, rate %+d ppm", this->drift_error_ms_, skew_ppm,
+               (int) ppm);
+      break;
+    }
+
+    case RAOP_STATS: {
+      const raop_stats_t *stats = va_arg(args, const raop_stats_t *);
+      LockGuard guard(this->network_stats_lock_);
+      this->network_stats_ = *stats;
       break;
     }
 
@@ -354,28 +455,35 @@ bool RAOPMediaPlayer::handle_raop_command(raop_event_t event, va_list args) {
   return true;
 }
 
-void RAOPMediaPlayer::handle_raop_data(const uint8_t *data, size_t len, uint32_t playtime) {
+audio_buffer_stats_t RAOPMediaPlayer::get_output_stats() const {
+  audio_buffer_stats_t stats{};
+  audio_buffer_get_stats(&stats);
+  return stats;
+}
+
+raop_stats_t RAOPMediaPlayer::get_network_stats() const {
+  LockGuard guard(this->network_stats_lock_);
+  return this->network_stats_;
+}
+
+void RAOPMediaPlayer::handle_raop_data(const uint8_t *data, size_t len, int64_t playtime) {
   if (!audio_buffer_write(data, len, playtime)) {
     ESP_LOGW(TAG, "Failed to buffer audio frame");
   }
 }
 
-void RAOPMediaPlayer::write_audio_data(const uint8_t *data, size_t len) {
+void RAOPMediaPlayer::write_audio_data(uint8_t *data, size_t len) {
   if (!this->i2s_locked_ || this->tx_handle_ == nullptr)
     return;
 
-  const uint8_t *output_data = data;
-  uint8_t temp_buffer[len];
-
-  // Apply volume if needed
+  // data is borrowed from the audio buffer, so volume is applied in place and
+  // I2S reads straight from the ring
   if (this->volume_ < 1.0f || this->muted_) {
-    memcpy(temp_buffer, data, len);
-    this->apply_volume_(temp_buffer, len);
-    output_data = temp_buffer;
+    this->apply_volume_(data, len);
   }
 
   size_t bytes_written = 0;
-  esp_err_t err = i2s_channel_write(this->tx_handle_, output_data, len, &bytes_written, portMAX_DELAY);
+  esp_err_t err = i2s_channel_write(this->tx_handle_, data, len, &bytes_written, portMAX_DELAY);
 
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "I2S write failed: %s", esp_err_to_name(err));
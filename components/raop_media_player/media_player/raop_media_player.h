@@ -1,6 +1,7 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
 #include "esphome/components/media_player/media_player.h"
 #include "esphome/components/i2s_audio/i2s_audio.h"
 
@@ -26,6 +27,16 @@ class RAOPMediaPlayer : public Component,
 
   void set_dout_pin(uint8_t pin) { this->dout_pin_ = pin; }
   void set_buffer_frames(uint32_t frames) { this->buffer_frames_ = frames; }
+  void set_pre_roll(uint32_t ms) { this->pre_roll_ms_ = ms; }
+  void set_dma_desc_num(uint32_t num) { this->dma_desc_num_ = num; }
+  void set_dma_frame_num(uint32_t num) { this->dma_frame_num_ = num; }
+  void set_lazy_decode(bool lazy) { this->lazy_decode_ = lazy; }
+
+  // Output diagnostics (underruns, pre-rolls, start error) of the current stream
+  audio_buffer_stats_t get_output_stats() const;
+  // Retransmission, loss, jitter and arrival figures of the current (or last)
+  // stream, as of the last RAOP_STATS (every 1000 frames played)
+  raop_stats_t get_network_stats() const;
 
   // MediaPlayer control methods
   media_player::MediaPlayerTraits get_traits() override;
@@ -34,8 +45,8 @@ class RAOPMediaPlayer : public Component,
 
   // Called from C callbacks
   bool handle_raop_command(raop_event_t event, va_list args);
-  void handle_raop_data(const uint8_t *data, size_t len, uint32_t playtime);
-  void write_audio_data(const uint8_t *data, size_t len);
+  void handle_raop_data(const uint8_t *data, size_t len, int64_t playtime);
+  void write_audio_data(uint8_t *data, size_t len);
 
  protected:
   void start_raop_();
@@ -50,9 +61,16 @@ class RAOPMediaPlayer : public Component,
   i2s_chan_handle_t tx_handle_{nullptr};
 
   uint8_t dout_pin_;
-  uint32_t buffer_frames_{1024};
+  uint32_t buffer_frames_{1024};  // 0 = size from free PSRAM at session setup
+  uint32_t pre_roll_ms_{200};
+  uint32_t dma_desc_num_{6};
+  uint32_t dma_frame_num_{480};  // samples per DMA buffer
   float volume_{1.0f};
+  float drift_error_ms_{0.0f};
+  raop_stats_t network_stats_{};
+  mutable Mutex network_stats_lock_;  // updated from the RTP side
   bool muted_{false};
+  bool lazy_decode_{false};  // keep ALAC in the jitter buffer, decode at playout
   bool i2s_locked_{false};
   bool stream_active_{false};
 };
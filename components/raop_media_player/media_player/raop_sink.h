@@ -16,11 +16,39 @@
 
 typedef enum { 	RAOP_SETUP, RAOP_STREAM, RAOP_PLAY, RAOP_FLUSH, RAOP_METADATA, RAOP_ARTWORK, RAOP_PROGRESS, RAOP_PAUSE, RAOP_STOP, RAOP_STALLED,
 				RAOP_VOLUME, RAOP_TIMING, RAOP_PREV, RAOP_NEXT, RAOP_REW, RAOP_FWD,
-				RAOP_VOLUME_UP, RAOP_VOLUME_DOWN, RAOP_RESUME, RAOP_TOGGLE } raop_event_t ;
+				RAOP_VOLUME_UP, RAOP_VOLUME_DOWN, RAOP_RESUME, RAOP_TOGGLE, RAOP_STATS } raop_event_t ;
 
+// histogram bins, bin i counts values below RAOP_HIST_EDGES[i] per mille of
+// the stream latency and the last one all above; the first bin of lead holds
+// packets arriving past their playtime
+#define RAOP_HIST_BINS	8
+#define RAOP_HIST_EDGES	{ 0, 250, 500, 750, 900, 950, 1000 }
+
+// network side statistics of the current stream, sent with RAOP_STATS
+typedef struct {
+	uint32_t nack_requests;		// resend requests sent
+	uint32_t frames_requested;	// missing frames asked for again, retries included
+	uint32_t frames_recovered;	// requested frames resent in time to be played
+	uint32_t frames_expired;	// requested frames still missing at their playtime
+	uint32_t rtt_ms;			// smoothed NTP round trip, 0 until measured
+	uint32_t silent_frames;		// missing at their playtime, concealed
+	uint32_t discarded;
+	int32_t clock_skew_ppm;		// sender clock rate against ours, positive when faster
+	uint32_t jitter_us;			// RFC 3550 interarrival jitter of audio packets
+	uint32_t lead_hist[RAOP_HIST_BINS];		// time left to playtime when a packet reaches the jitter buffer
+	uint32_t depth_hist[RAOP_HIST_BINS];	// audio the jitter buffer holds at that time
+	uint32_t playout_us;		// mean time from arrival to playtime of the frames buffered
+	int32_t playout_min_us;		// the least of it, negative when a frame came in late
+} raop_stats_t;
+
+// RAOP_SETUP comes with (uint8_t **buffer, size_t *size, bool *lazy_decode,
+// size_t pcm_size, size_t lazy_size): the sink may hand the jitter buffer
+// memory to carve its slots from, pcm_size being all it takes when frames
+// are kept decoded and lazy_size when they are kept compressed
 typedef bool (*raop_cmd_cb_t)(raop_event_t event, ...);
 typedef bool (*raop_cmd_vcb_t)(raop_event_t event, va_list args);
-typedef void (*raop_data_cb_t)(const uint8_t *data, size_t len, uint32_t playtime);
+// playtime is the local time (esp_timer µs) at which the first sample is due
+typedef void (*raop_data_cb_t)(const uint8_t *data, size_t len, int64_t playtime);
 
 /**
  * @brief     init sink mode (need to be provided)
@@ -0,0 +1,61 @@
+#include "resampler.h"
+#include <string.h>
+
+#define PHASE_ONE (1ULL << 32)
+
+void resampler_init(resampler_t *rs, const int16_t last[2]) {
+    memset(rs, 0, sizeof(*rs));
+    if (last) {
+        for (int i = 0; i < 4; i++) memcpy(rs->history[i], last, sizeof(rs->history[i]));
+    }
+    rs->step = PHASE_ONE;
+    // Two extra input samples have to enter the history before history[1] is
+    // the first real sample, so start two samples "ahead"
+    rs->phase = 2 * PHASE_ONE;
+}
+
+void resampler_set_ppm(resampler_t *rs, int32_t ppm) {
+    if (ppm > RESAMPLER_MAX_PPM) ppm = RESAMPLER_MAX_PPM;
+    else if (ppm < -RESAMPLER_MAX_PPM) ppm = -RESAMPLER_MAX_PPM;
+    rs->step = PHASE_ONE + (int64_t)PHASE_ONE / 1000000 * ppm;
+}
+
+// Catmull-Rom between h1 and h2 at mu (Q15), Horner form:
+// y = h1 + mu/2 * (c + mu * (b + mu * a))
+static inline int16_t interpolate(int32_t h0, int32_t h1, int32_t h2, int32_t h3, int32_t mu) {
+    int64_t a = 3 * (h1 - h2) + h3 - h0;
+    int64_t b = 2 * h0 - 5 * h1 + 4 * h2 - h3;
+    int64_t c = h2 - h0;
+    int64_t t = b + ((a * mu) >> 15);
+    t = c + ((t * mu) >> 15);
+    int32_t y = h1 + (int32_t)((t * mu) >> 16);
+
+    if (y > INT16_MAX) return INT16_MAX;
+    if (y < INT16_MIN) return INT16_MIN;
+    return (int16_t)y;
+}
+
+size_t resampler_process(resampler_t *rs, const int16_t *in, size_t in_frames, int16_t *out) {
+    int16_t (*h)[2] = rs->history;
+    size_t produced = 0;
+
+    for (size_t i = 0; i < in_frames; i++) {
+        memmove(h[0], h[1], 3 * sizeof(h[0]));
+        h[3][0] = in[2 * i];
+        h[3][1] = in[2 * i + 1];
+
+        // Emit every output sample whose position falls between h[1] and h[2]
+        while (rs->phase < PHASE_ONE) {
+            int32_t mu = (int32_t)(rs->phase >> 17);
+            for (int ch = 0; ch < 2; ch++) {
+                out[2 * produced + ch] = interpolate(h[0][ch], h[1][ch], h[2][ch], h[3][ch], mu);
+            }
+            produced++;
+            rs->phase += rs->step;
+        }
+
+        rs->phase -= PHASE_ONE;
+    }
+
+    return produced;
+}
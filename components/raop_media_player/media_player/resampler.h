@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Asynchronous sample-rate converter for 16-bit stereo, used to absorb
+// ppm-level clock skew between sender and DAC. Cubic Hermite (Catmull-Rom)
+// interpolation evaluated Farrow-style in fixed point: no tables, no floats.
+typedef struct {
+    uint64_t step;          // input samples per output sample, Q32.32
+    uint64_t phase;         // position past history[1], Q32.32
+    int16_t history[4][2];  // last four stereo input samples
+} resampler_t;
+
+// Largest ratio deviation accepted by resampler_set_ppm
+#define RESAMPLER_MAX_PPM 1000
+
+// Output room needed for in_frames input frames at any accepted ratio
+#define RESAMPLER_MAX_OUTPUT(in_frames) ((in_frames) + (in_frames) / 512 + 2)
+
+// Reset to unity ratio. The history is primed so that the first output sample
+// is exactly the first input sample. last is the stereo sample output right
+// before it (NULL at the start of a stream, i.e. silence): interpolation then
+// runs on the real waveform, and engaging the resampler on a running stream
+// adds no discontinuity, only a two sample delay.
+void resampler_init(resampler_t *rs, const int16_t last[2]);
+
+// Positive ppm consumes input faster than real time (drains the buffer),
+// negative ppm slower. Clamped to +/-RESAMPLER_MAX_PPM.
+void resampler_set_ppm(resampler_t *rs, int32_t ppm);
+
+// Convert interleaved stereo frames. out must hold RESAMPLER_MAX_OUTPUT(in_frames)
+// frames; returns the number of frames produced.
+size_t resampler_process(resampler_t *rs, const int16_t *in, size_t in_frames, int16_t *out);
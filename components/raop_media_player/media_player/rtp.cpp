@@ -45,14 +45,17 @@
 #include "log_util.h"
 #include "util.h"
 
+#include "cipher.h"
+#include "clock_sync.h"
+#include "plc.h"
+
 #ifdef WIN32
-#include <openssl/aes.h>
 #include "alac_wrapper.h"
 #define MSG_DONTWAIT 0
 #else
 #include "esp_system.h"
-#include <mbedtls/version.h>
-#include <mbedtls/aes.h>
+#include "esp_cpu.h"
+#include "freertos/queue.h"
 #include "alac_wrapper.h"
 #endif
 
@@ -66,50 +69,120 @@
 extern log_level 	raop_loglevel;
 static log_level 	*loglevel = &raop_loglevel;
 
-//#define __RTP_STORE
+// built with __RTP_STORE (-D__RTP_STORE, for rtp.h as well), everything
+// received is captured with RECORD and FLUSH to RTP_CAPTURE, so that
+// rtp_replay() can run it again through the same path (see tests/host for the
+// replay tool). On the device, RTP_CAPTURE must be on a mounted VFS, fopen()
+// has no current directory there
+#ifdef __RTP_STORE
+#ifndef RTP_CAPTURE
+#define RTP_CAPTURE			"/sdcard/airplay.rtpcap"
+#endif
+#define CAPTURE_MAGIC		"RTPC"
+#define CAPTURE_VERSION		1
+#define CAPTURE_HEADER		46		// up to the fmtp string
+#define CAPTURE_RECORD_HDR	11
+#endif
 
-// default buffer size
+// jitter buffer size, holds the latency plus BUFFER_HEADROOM samples for
+// frames sent early and resends
 #define BUFFER_FRAMES_MAX 	((RAOP_SAMPLE_RATE * 10) / 352 )
 #define BUFFER_FRAMES_MIN 	( (150 * RAOP_SAMPLE_RATE * 2) / (352 * 100) )
+#define BUFFER_HEADROOM		RAOP_SAMPLE_RATE
 #define MAX_PACKET       1408
 #define MIN_LATENCY		11025
 #define MAX_LATENCY   	( (120 * RAOP_SAMPLE_RATE * 2) / 100 )
 
 #define RTP_STACK_SIZE	(4*1024)
 
+// receive/decode split: the RTP thread queues raw packets in DECODE_SLOTS slots
+// and the decode task turns them into PCM, on the other core when it can
+#define DECODE_SLOTS		64
+#define DECODE_STACK_SIZE	(4*1024)
+#define DECODE_WAIT_MS		50
+#define DECODE_BATCH		8		// packets taken (and decrypted) per decoder wakeup
+
+// lazy decode: compressed packets are stored in LAZY_CHUNK pieces from a shared
+// pool and the pool is sized assuming they are LAZY_RATIO % of their PCM size
+#define LAZY_CHUNK		256
+#define LAZY_CHUNKS_MAX	((MAX_PACKET + LAZY_CHUNK - 1) / LAZY_CHUNK)
+#define LAZY_RATIO		70
+
 #define RTP_SYNC	(0x01)
 #define NTP_SYNC	(0x02)
 
+// retransmission: retry after the RFC 6298 timeout computed from the NTP round
+// trip (RESEND_TO until we have one), doubled at each retry and for at most
+// NACK_RETRIES requests per frame, merging ranges split by up to NACK_MERGE
+// received frames, and scanning at most every NACK_TICK ms
 #define RESEND_TO	250
+#define RESEND_MIN	20
+#define NACK_RETRIES	6
+#define NACK_MERGE	2
+#define NACK_TICK	10
+
+// packets read from one socket per select() wakeup, and wakeup histogram size
+#ifdef WIN32
+#define RECV_BATCH	1		// no MSG_DONTWAIT, sockets are blocking
+#else
+#define RECV_BATCH	16
+#endif
+#define RECV_HIST_BINS	9
 
 enum { DATA = 0, CONTROL, TIMING };
 
-static const u8_t silence_frame[MAX_PACKET] = { 0 };
-uint32_t buffer_frames = ((150 * RAOP_SAMPLE_RATE * 2) / (352 * 100));
+/*
+ Capture file, all fields big endian
+   header: "RTPC", u16 version, u32 latency, u8 lazy, u8 encrypted, key[16],
+           iv[16], u16 fmtp length, fmtp
+   record: u64 arrival (esp_timer µs), u8 source, u16 length, bytes
+ Packets are stored as received with their socket (DATA, CONTROL, TIMING) as
+ source; CAPTURE_RECORD and CAPTURE_FLUSH carry u16 seqno and u32 rtptime.
+*/
+#ifdef __RTP_STORE
+enum { CAPTURE_RECORD = 3, CAPTURE_FLUSH };
+#endif
 
 typedef u16_t seq_t;
-typedef struct __attribute__((__packed__)) audio_buffer_entry {   // decoded audio packets
-	u32_t rtptime, last_resend;
+// payload side of a jitter buffer slot, what is scanned per packet lives in
+// the ab_* arrays of the context
+typedef struct audio_buffer_entry {   // decoded audio packets
 	s16_t *data;
     u16_t len;
-    u8_t ready;
     u8_t allocated;
-    u8_t missed;
+	u8_t chunks;			// lazy decode: pool chunks held, len is the compressed size
+	u16_t chunk[LAZY_CHUNKS_MAX];
 } abuf_t;
 
+typedef struct {
+	seq_t seqno;
+	u32_t rtptime;
+	bool first;
+	bool resent;			// came as the answer to a resend request
+	u16_t len;
+	char data[MAX_PACKET];
+} rtp_packet_t;
+
 typedef struct rtp_s {
 #ifdef __RTP_STORE
-	FILE *rtpIN, *rtpOUT;
+	FILE *capture;
+	pthread_mutex_t capture_mutex;	// RECORD and FLUSH come from the RTSP thread
+	bool replay;			// fed by rtp_replay(), time is the recorded one
+	u64_t replay_now;
+	const rtp_channel_t *channel;	// what a replay goes through, if anything
 #endif
 	bool running;
-	unsigned char aesiv[16];
-#ifdef WIN32
-	AES_KEY aes;
-#else
-	mbedtls_aes_context aes;
-#endif
+	cipher_t cipher;
 	bool decrypt;
-	u8_t *decrypt_buf;
+	s16_t *decode_buf;		// PCM of the packet being decoded, before it is placed
+	bool lazy;				// jitter buffer holds compressed packets, decoded at playout
+	struct {
+		u8_t *pool;
+		u16_t *free;		// stack of free chunk indexes
+		u16_t count, top;
+		bool allocated;
+		u8_t *packet;		// reassembled payload to decode
+	} chunks;
 	u32_t frame_size, frame_duration;
 	u32_t in_frames, out_frames;
 	struct in_addr host;
@@ -119,17 +192,47 @@ typedef struct rtp_s {
 		int sock;
 	} rtp_sockets[3]; 					 // data, control, timing
 	struct timing_s {
-		u64_t local, remote;
+		u64_t local, remote;	// µs, NTP
 	} timing;
+	clock_sync_t clock;		// sender clock model built from timing replies
 	struct {
-		u32_t 	rtp, time;
+		u64_t	rtp;		// extended (unwrapped) rtptime of the anchor
+		u64_t	time;		// local µs at which it plays
 		u8_t  	status;
 	} synchro;
 	int latency;			// rtp hold depth in samples
+	int sync_count;			// sync packets left before the next timing request
 	u32_t resent_req, resent_rec;	// total resent + recovered frames
-	u32_t silent_frames;	// total silence frames
+	struct {
+		u32_t srtt, rttvar;			// ms, scaled by 8 and 4
+		u32_t last_scan;
+		u32_t requests, expired;	// NACKs sent, requested frames that missed their playtime
+		u64_t scan_cycles;
+		u32_t scans;
+	} nack;
+	u32_t silent_frames;	// total frames missing at their playtime, concealed
+	plc_t plc;
+	u64_t plc_cycles;
 	u32_t discarded;
-	abuf_t audio_buffer[BUFFER_FRAMES_MAX];
+	u32_t recv_hist[RECV_HIST_BINS];	// wakeups by packets processed, last bin is "or more"
+	struct {
+		bool primed;
+		s32_t transit;			// arrival - rtptime of the last packet, in samples
+		u32_t jitter;			// samples, scaled by 16
+		u32_t lead[RAOP_HIST_BINS], depth[RAOP_HIST_BINS];
+		s64_t wait_sum;			// arrival to playtime of the frames placed, us
+		s64_t wait_min;
+		u32_t waits;
+	} arrival;
+	// jitter buffer of buffer_frames slots (a power of two) indexed by seqno,
+	// as separate arrays so that gap scans and flushes go a word at a time
+	abuf_t *audio_buffer;
+	u32_t buffer_frames;
+	u32_t *ab_ready, *ab_missed;		// bitmaps, missed is set when replaced by silence
+	u32_t *ab_held;						// lazy decode: bitmap of slots holding pool chunks
+	u32_t flushes;						// buffer resets so far, a decode outside ab_mutex checks it
+	u32_t *ab_rtptime, *ab_resend;		// expected rtptime, last resend request (ms)
+	u8_t *ab_nacks;						// resend requests, NACK_RETRIES at most
 	seq_t ab_read, ab_write;
 	pthread_mutex_t ab_mutex;
 #ifdef WIN32
@@ -138,6 +241,14 @@ typedef struct rtp_s {
 	TaskHandle_t thread, joiner;
 	StaticTask_t *xTaskBuffer;
     StackType_t xStack[RTP_STACK_SIZE] __attribute__ ((aligned (4)));
+	struct {
+		rtp_packet_t *slots;
+		QueueHandle_t free, ready;	// slot pointers
+		TaskHandle_t task;
+		u32_t peak, dropped;
+		u64_t crypt_cycles;
+		u32_t crypt_packets;
+	} decoder;
 #endif
 
 	struct alac_codec_s *alac_codec;
@@ -149,18 +260,48 @@ typedef struct rtp_s {
 } rtp_t;
 
 
-#define BUFIDX(seqno) ((seq_t)(seqno) % buffer_frames)
-static void 	buffer_alloc(abuf_t *audio_buffer, int size, uint8_t *buf, size_t buf_size);
-static void 	buffer_release(abuf_t *audio_buffer);
-static void 	buffer_reset(abuf_t *audio_buffer);
+#define BUFIDX(ctx, seqno) ((seq_t)(seqno) & ((ctx)->buffer_frames - 1))
+// extend a 32 bits rtptime next to an extended one, it may be either side of it
+#define RTP_UNWRAP(ext, rtptime) ((ext) + (s64_t) (s32_t) ((u32_t) (rtptime) - (u32_t) (ext)))
+// local time (esp_timer µs) at which the frame with this rtptime must be played
+#define PLAYTIME(ctx, rtptime) ((ctx)->synchro.time + (s64_t) (RTP_UNWRAP((ctx)->synchro.rtp, rtptime) - (ctx)->synchro.rtp) * 1000000 / RAOP_SAMPLE_RATE)
+#define BIT_TEST(map, n) ((map)[(n) >> 5] & (1u << ((n) & 31)))
+#define BIT_SET(map, n) ((map)[(n) >> 5] |= 1u << ((n) & 31))
+#define BIT_CLEAR(map, n) ((map)[(n) >> 5] &= ~(1u << ((n) & 31)))
+#define ABUF_READY(ctx, idx) BIT_TEST((ctx)->ab_ready, idx)
+static u32_t 	buffer_slots(int latency, int frame_size);
+static bool 	buffer_create(rtp_t *ctx);
+static void 	buffer_alloc(rtp_t *ctx, int size, uint8_t *buf, size_t buf_size);
+static void 	buffer_release(rtp_t *ctx);
+static void 	buffer_destroy(rtp_t *ctx);
+static size_t 	chunks_count(u32_t slots, int frame_size);
+static void 	chunks_alloc(rtp_t *ctx, uint8_t *buf, size_t buf_size);
+static void 	chunks_release(rtp_t *ctx);
+static void 	buffer_reset(rtp_t *ctx);
 static void 	buffer_push_packet(rtp_t *ctx);
 static bool 	rtp_request_resend(rtp_t *ctx, seq_t first, seq_t last);
+static void 	nack_schedule(rtp_t *ctx, u64_t now, u64_t hold);
+static void 	nack_update_rtt(rtp_t *ctx, u32_t rtt);
+static void 	nack_expire(rtp_t *ctx, u32_t idx);
 static bool 	rtp_request_timing(rtp_t *ctx);
 static int	  	seq_order(seq_t a, seq_t b);
+static bool		rtp_setup(rtp_t *ctx, int latency, char *aeskey, char *aesiv, char *fmtpstr,
+						  uint8_t *buffer, size_t size, bool lazy_decode, raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb);
+static void 	rtp_process(rtp_t *ctx, int source, char *packet, ssize_t plen);
+static void 	arrival_update(rtp_t *ctx, u32_t rtptime, u64_t now);
+static void 	arrival_hist(rtp_t *ctx, u32_t rtptime, u64_t now);
+static void 	arrival_wait(rtp_t *ctx, u32_t rtptime, u64_t now);
+#ifdef __RTP_STORE
+static FILE		*capture_open(const char *path, int latency, char *aeskey, char *aesiv, char *fmtpstr, bool lazy_decode);
+static void 	capture_write(rtp_t *ctx, int source, const void *data, size_t len);
+static void 	capture_event(rtp_t *ctx, int source, seq_t seqno, u32_t rtptime);
+#endif
 #ifdef WIN32
 static void 	*rtp_thread_func(void *arg);
 #else
 static void 	rtp_thread_func(void *arg);
+static bool 	decoder_start(rtp_t *ctx, BaseType_t core_id);
+static void 	decoder_func(void *arg);
 #endif
 
 /*---------------------------------------------------------------------------*/
@@ -206,12 +347,10 @@ static struct alac_codec_s* alac_init(int fmtp[12]) {
 /*---------------------------------------------------------------------------*/
 rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv, char *fmtpstr,
 								short unsigned pCtrlPort, short unsigned pTimingPort,
-								uint8_t *buffer, size_t size,
+								uint8_t *buffer, size_t size, bool lazy_decode,
 								raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb)
 {
-	int i = 0;
-	char *arg;
-	int fmtp[12];
+	int i;
 	bool rc = true;
 	rtp_t *ctx = calloc(1, sizeof(rtp_t));
 	rtp_resp_t resp = { 0, 0, 0, NULL };
@@ -219,47 +358,19 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 	if (!ctx) return resp;
 
 	ctx->host = host;
-	ctx->decrypt = false;
-	ctx->cmd_cb = cmd_cb;
-	ctx->data_cb = data_cb;
 	ctx->rtp_host.sin_family = AF_INET;
 	ctx->rtp_host.sin_addr.s_addr = INADDR_ANY;
-	pthread_mutex_init(&ctx->ab_mutex, 0);
-	ctx->first_seqno = -1;
-	ctx->latency = latency;
-	ctx->ab_read = ctx->ab_write;
 
 #ifdef __RTP_STORE
-	ctx->rtpIN = fopen("airplay.rtpin", "wb");
-	ctx->rtpOUT = fopen("airplay.rtpout", "wb");
+	// before fmtp is parsed (and cut in pieces)
+	ctx->capture = capture_open(RTP_CAPTURE, latency, aeskey, aesiv, fmtpstr, lazy_decode);
+	if (ctx->capture) pthread_mutex_init(&ctx->capture_mutex, 0);
 #endif
 
 	ctx->rtp_sockets[CONTROL].rport = pCtrlPort;
 	ctx->rtp_sockets[TIMING].rport = pTimingPort;
 
-	if (aesiv && aeskey) {
-		memcpy(ctx->aesiv, aesiv, 16);
-#ifdef WIN32
-		AES_set_decrypt_key((unsigned char*) aeskey, 128, &ctx->aes);
-#else
-		memset(&ctx->aes, 0, sizeof(mbedtls_aes_context));
-		mbedtls_aes_setkey_dec(&ctx->aes, (unsigned char*) aeskey, 128);
-#endif
-		ctx->decrypt = true;
-		ctx->decrypt_buf = (u8_t *)malloc(MAX_PACKET);
-	}
-
-	memset(fmtp, 0, sizeof(fmtp));
-	while ((arg = strsep(&fmtpstr, " \t")) != NULL) fmtp[i++] = atoi(arg);
-
-	ctx->frame_size = fmtp[1];
-	ctx->frame_duration = (ctx->frame_size * 1000) / RAOP_SAMPLE_RATE;
-
-	// alac decoder
-	ctx->alac_codec = alac_init(fmtp);
-	rc &= ctx->alac_codec != NULL;
-
-	buffer_alloc(ctx->audio_buffer, ctx->frame_size*4, buffer, size);
+	rc &= rtp_setup(ctx, latency, aeskey, aesiv, fmtpstr, buffer, size, lazy_decode, cmd_cb, data_cb);
 
 	// create rtp ports
 	for (i = 0; i < 3; i++) {
@@ -279,6 +390,8 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 #else
 	ctx->xTaskBuffer = (StaticTask_t*) heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 	BaseType_t core_id = (CONFIG_PTHREAD_TASK_CORE_DEFAULT == -1) ? tskNO_AFFINITY : CONFIG_PTHREAD_TASK_CORE_DEFAULT;
+	// decoder first, the RTP thread hands packets over as soon as it runs
+	if (!decoder_start(ctx, core_id)) LOG_WARN("[%p]: no decode task, decoding on RTP thread", ctx);
 	ctx->thread = xTaskCreateStaticPinnedToCore( (TaskFunction_t) rtp_thread_func, "RTP_thread", RTP_STACK_SIZE, ctx,
 																							CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, ctx->xStack, ctx->xTaskBuffer,
 																							core_id);
@@ -295,6 +408,54 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 	return resp;
 }
 
+/*---------------------------------------------------------------------------*/
+// codec, cipher and buffers, all that live capture and replay share
+static bool rtp_setup(rtp_t *ctx, int latency, char *aeskey, char *aesiv, char *fmtpstr,
+					  uint8_t *buffer, size_t size, bool lazy_decode, raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb) {
+	int i = 0;
+	char *arg;
+	int fmtp[12];
+	bool rc = true;
+
+	ctx->decrypt = false;
+	ctx->cmd_cb = cmd_cb;
+	ctx->data_cb = data_cb;
+	pthread_mutex_init(&ctx->ab_mutex, 0);
+	ctx->first_seqno = -1;
+	ctx->latency = latency;
+	ctx->ab_read = ctx->ab_write;
+
+	if (aesiv && aeskey) {
+		cipher_init(&ctx->cipher, (u8_t*) aeskey, (u8_t*) aesiv);
+		ctx->decrypt = true;
+	}
+
+	memset(fmtp, 0, sizeof(fmtp));
+	while (i < 12 && (arg = strsep(&fmtpstr, " \t")) != NULL) fmtp[i++] = atoi(arg);
+
+	ctx->frame_size = fmtp[1];
+	ctx->frame_duration = (ctx->frame_size * 1000) / RAOP_SAMPLE_RATE;
+
+	// alac decoder
+	ctx->alac_codec = alac_init(fmtp);
+	rc &= ctx->alac_codec != NULL;
+	ctx->decode_buf = (s16_t*) malloc(ctx->frame_size*4);
+	rc &= ctx->decode_buf != NULL;
+	rc &= plc_init(&ctx->plc, ctx->frame_size);
+
+	ctx->lazy = lazy_decode;
+	if (!buffer_create(ctx)) {
+		rc = false;
+	} else if (ctx->lazy) {
+		chunks_alloc(ctx, buffer, size);
+		rc &= ctx->chunks.pool != NULL && ctx->chunks.packet != NULL;
+	} else {
+		buffer_alloc(ctx, ctx->frame_size*4, buffer, size);
+	}
+
+	return rc;
+}
+
 /*---------------------------------------------------------------------------*/
 void rtp_end(rtp_t *ctx)
 {
@@ -303,6 +464,7 @@ void rtp_end(rtp_t *ctx)
 	if (!ctx) return;
 
 	if (ctx->running) {
+		raop_stats_t stats;
 #if !defined WIN32
 		ctx->joiner = xTaskGetCurrentTaskHandle();
 #endif
@@ -310,31 +472,63 @@ void rtp_end(rtp_t *ctx)
 #ifdef WIN32
 		pthread_join(ctx->thread, NULL);
 #else
+		// both the RTP thread and the decoder (if any) notify once they are done
 		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+		if (ctx->decoder.task) ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
 		vTaskDelete(ctx->thread);
 		SAFE_PTR_FREE(ctx->xTaskBuffer);
 #endif
+		// final figures, nothing updates them anymore
+		rtp_get_stats(ctx, &stats);
+		ctx->cmd_cb(RAOP_STATS, &stats);
 	}
 
-	for (i = 0; i < 3; i++) closesocket(ctx->rtp_sockets[i].sock);
+#ifndef WIN32
+	if (ctx->decoder.task) {
+		LOG_INFO("[%p]: decoder queue peak %u/%u, dropped %u, decrypt %u cycles/packet", ctx, ctx->decoder.peak, DECODE_SLOTS,
+				 ctx->decoder.dropped, ctx->decoder.crypt_packets ? (u32_t) (ctx->decoder.crypt_cycles / ctx->decoder.crypt_packets) : 0);
+	}
+	LOG_INFO("[%p]: %u resend scans, %u cycles/scan", ctx, ctx->nack.scans,
+			 ctx->nack.scans ? (u32_t) (ctx->nack.scan_cycles / ctx->nack.scans) : 0);
+	LOG_INFO("[%p]: %u frames concealed, %u cycles/frame", ctx, ctx->silent_frames,
+			 ctx->silent_frames ? (u32_t) (ctx->plc_cycles / ctx->silent_frames) : 0);
+	if (ctx->decoder.free) vQueueDelete(ctx->decoder.free);
+	if (ctx->decoder.ready) vQueueDelete(ctx->decoder.ready);
+	SAFE_PTR_FREE(ctx->decoder.slots);
+#endif
 
-	if (ctx->alac_codec) alac_delete_decoder(ctx->alac_codec);
-	if (ctx->decrypt_buf) free(ctx->decrypt_buf);
+	LOG_INFO("[%p]: packets per wakeup 0:%u 1:%u 2:%u 3:%u 4:%u 5:%u 6:%u 7:%u 8+:%u", ctx,
+			 ctx->recv_hist[0], ctx->recv_hist[1], ctx->recv_hist[2], ctx->recv_hist[3], ctx->recv_hist[4],
+			 ctx->recv_hist[5], ctx->recv_hist[6], ctx->recv_hist[7], ctx->recv_hist[8]);
 
-	pthread_mutex_destroy(&ctx->ab_mutex);
-	buffer_release(ctx->audio_buffer);
+	for (i = 0; i < 3; i++) if (ctx->rtp_sockets[i].sock > 0) closesocket(ctx->rtp_sockets[i].sock);
 
-	free(ctx);
+	if (ctx->alac_codec) alac_delete_decoder(ctx->alac_codec);
+	if (ctx->decrypt) cipher_free(&ctx->cipher);
+	if (ctx->decode_buf) free(ctx->decode_buf);
+	plc_free(&ctx->plc);
 
+	pthread_mutex_destroy(&ctx->ab_mutex);
+	if (ctx->lazy) chunks_release(ctx);
+	else buffer_release(ctx);
+	buffer_destroy(ctx);
 #ifdef __RTP_STORE
-	fclose(ctx->rtpIN);
-	fclose(ctx->rtpOUT);
+	if (ctx->capture) {
+		fclose(ctx->capture);
+		pthread_mutex_destroy(&ctx->capture_mutex);
+	}
 #endif
+
+	free(ctx);
 }
 
 /*---------------------------------------------------------------------------*/
 bool rtp_flush(rtp_t *ctx, unsigned short seqno, unsigned int rtptime, bool exit_locked)
 {
+#ifdef __RTP_STORE
+	capture_event(ctx, CAPTURE_FLUSH, seqno, rtptime);
+#endif
+	ctx->arrival.primed = false;
     pthread_mutex_lock(&ctx->ab_mutex);
 
     // always store flush seqno as we only want stricly above it, even when equal to RECORD
@@ -343,7 +537,7 @@ bool rtp_flush(rtp_t *ctx, unsigned short seqno, unsigned int rtptime, bool exit
 
     // no need to stop playing if recent or equal to record - but first_seqno is needed
     if (ctx->state == RTP_PLAY) {
-        buffer_reset(ctx->audio_buffer);
+        buffer_reset(ctx);
         ctx->state = RTP_WAIT;
         flushed = true;
         LOG_INFO("[%p]: FLUSH packets below %hu - %u", ctx, seqno, rtptime);
@@ -361,44 +555,342 @@ void rtp_flush_release(rtp_t *ctx) {
 
 /*---------------------------------------------------------------------------*/
 void rtp_record(rtp_t *ctx, unsigned short seqno, unsigned rtptime) {
+#ifdef __RTP_STORE
+	capture_event(ctx, CAPTURE_RECORD, seqno, rtptime);
+#endif
+	ctx->arrival.primed = false;
     ctx->first_seqno = (seqno || rtptime) ? seqno : -1;
 	ctx->state = RTP_WAIT;
 	LOG_INFO("[%p]: record %hu - %u", ctx, seqno, rtptime);
 }
 
 /*---------------------------------------------------------------------------*/
-static void buffer_alloc(abuf_t *audio_buffer, int size, uint8_t *buf, size_t buf_size) {
-    for (buffer_frames = 0; buf && buf_size >= size && buffer_frames < BUFFER_FRAMES_MAX; buffer_frames++) {
-    	audio_buffer[buffer_frames].data = (s16_t*) buf;
-		audio_buffer[buffer_frames].allocated = 0;
-        audio_buffer[buffer_frames].ready = 0;
-        buf += size;
-        buf_size -= size;
-    }
+// what rtp_init() takes from the sink's buffer for a session, a slot of PCM
+// per frame or the chunk pool with its free stack when decoding lazily, so
+// that RAOP_SETUP allocates no more than that
+size_t rtp_buffer_size(int latency, const char *fmtpstr, bool lazy_decode) {
+	int frame_size = 0;
+	u32_t slots;
+
+	if (fmtpstr && sscanf(fmtpstr, "%*d %d", &frame_size) != 1) frame_size = 0;
+	if (frame_size <= 0) return 0;
+	slots = buffer_slots(latency, frame_size);
+	if (lazy_decode) return chunks_count(slots, frame_size) * (LAZY_CHUNK + sizeof(u16_t));
+	return (size_t) slots * frame_size * 4;
+}
+
+/*---------------------------------------------------------------------------*/
+// slots are sized from the latency announced at setup (the longest we accept
+// when there is none) and rounded up to a power of two, so that seqno wraps
+// land on the same slot and indexing is a mask; sync packets cannot ask for
+// more than they hold
+static u32_t buffer_slots(int latency, int frame_size) {
+	u32_t frames, slots;
+
+	if (!latency) latency = MAX_LATENCY;
+	frames = (latency + BUFFER_HEADROOM + frame_size - 1) / frame_size;
+	frames = max(min(frames, (u32_t) BUFFER_FRAMES_MAX), (u32_t) BUFFER_FRAMES_MIN);
+	for (slots = 32; slots < frames; slots <<= 1);
+
+	return slots;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool buffer_create(rtp_t *ctx) {
+	u32_t words;
+
+	if (!ctx->frame_size) return false;
+	ctx->buffer_frames = buffer_slots(ctx->latency, ctx->frame_size);
+	words = ctx->buffer_frames / 32;
+
+	ctx->audio_buffer = (abuf_t*) calloc(ctx->buffer_frames, sizeof(abuf_t));
+	ctx->ab_ready = (u32_t*) calloc(words, sizeof(u32_t));
+	ctx->ab_missed = (u32_t*) calloc(words, sizeof(u32_t));
+	ctx->ab_held = (u32_t*) calloc(words, sizeof(u32_t));
+	ctx->ab_rtptime = (u32_t*) calloc(ctx->buffer_frames, sizeof(u32_t));
+	ctx->ab_resend = (u32_t*) calloc(ctx->buffer_frames, sizeof(u32_t));
+	ctx->ab_nacks = (u8_t*) calloc(ctx->buffer_frames, sizeof(u8_t));
+
+	return ctx->audio_buffer && ctx->ab_ready && ctx->ab_missed && ctx->ab_held && ctx->ab_rtptime && ctx->ab_resend &&
+		   ctx->ab_nacks;
+}
 
-    LOG_INFO("allocated %d buffers (min=%d) from buffer of %zu bytes", buffer_frames, BUFFER_FRAMES_MIN, buf_size + buffer_frames * size);
+/*---------------------------------------------------------------------------*/
+static void buffer_destroy(rtp_t *ctx) {
+	SAFE_PTR_FREE(ctx->audio_buffer);
+	SAFE_PTR_FREE(ctx->ab_ready);
+	SAFE_PTR_FREE(ctx->ab_missed);
+	SAFE_PTR_FREE(ctx->ab_held);
+	SAFE_PTR_FREE(ctx->ab_rtptime);
+	SAFE_PTR_FREE(ctx->ab_resend);
+	SAFE_PTR_FREE(ctx->ab_nacks);
+}
 
-    for(; buffer_frames < BUFFER_FRAMES_MIN; buffer_frames++) {
-		audio_buffer[buffer_frames].data = (s16_t *)malloc(size);
-		audio_buffer[buffer_frames].allocated = 1;
-		audio_buffer[buffer_frames].ready = 0;
+/*---------------------------------------------------------------------------*/
+static void buffer_alloc(rtp_t *ctx, int size, uint8_t *buf, size_t buf_size) {
+	u32_t i;
+
+	for (i = 0; buf && buf_size >= size && i < ctx->buffer_frames; i++) {
+		ctx->audio_buffer[i].data = (s16_t*) buf;
+		buf += size;
+		buf_size -= size;
+	}
+
+	LOG_INFO("allocated %u of %u buffers from sink buffer, %zu bytes left", i, ctx->buffer_frames, buf_size);
+
+	for (; i < ctx->buffer_frames; i++) {
+		ctx->audio_buffer[i].data = (s16_t *)malloc(size);
+		ctx->audio_buffer[i].allocated = 1;
 	}
 }
 
 /*---------------------------------------------------------------------------*/
-static void buffer_release(abuf_t *audio_buffer) {
-	int i;
-	for (i = 0; i < buffer_frames; i++) {
-		if (audio_buffer[i].allocated) free(audio_buffer[i].data);
+static void buffer_release(rtp_t *ctx) {
+	u32_t i;
+	for (i = 0; ctx->audio_buffer && i < ctx->buffer_frames; i++) {
+		if (ctx->audio_buffer[i].allocated) free(ctx->audio_buffer[i].data);
 	}
 }
 
 /*---------------------------------------------------------------------------*/
-static void buffer_reset(abuf_t *audio_buffer) {
-	int i;
-	for (i = 0; i < buffer_frames; i++) audio_buffer[i].ready = 0;
+// clearing the ready bitmap is all a flush takes, a word per 32 frames
+static void buffer_reset(rtp_t *ctx) {
+	memset(ctx->ab_ready, 0, ctx->buffer_frames / 8);
+	plc_reset(&ctx->plc);
+	ctx->flushes++;
+}
+
+/*---------------------------------------------------------------------------*/
+// first seqno in [from, end) whose frame is not ready, end when there is none;
+// beyond buffer_frames seqnos the slots come round again, so that is the most
+// it looks at whatever the range
+static seq_t buffer_next_gap(rtp_t *ctx, seq_t from, seq_t end) {
+	seq_t stop = from + min((u32_t) (seq_t) (end - from), ctx->buffer_frames);
+
+	while (from != stop) {
+		u32_t idx = BUFIDX(ctx, from), bit = idx & 31;
+		u32_t span = min(32 - bit, (u32_t) (seq_t) (stop - from));
+		u32_t gaps = ~ctx->ab_ready[idx >> 5] >> bit;
+
+		if (span < 32) gaps &= (1u << span) - 1;
+		if (gaps) return from + __builtin_ctz(gaps);
+		from += span;
+	}
+
+	return end;
 }
 
+/*---------------------------------------------------------------------------*/
+// a replay runs on the arrival times it recorded
+static u64_t rtp_time(rtp_t *ctx) {
+#ifdef __RTP_STORE
+	if (ctx->replay) return ctx->replay_now;
+#endif
+	return gettime_us();
+}
+
+#ifdef __RTP_STORE
+/*---------------------------------------------------------------------------*/
+static void put16(u8_t *p, u16_t v) {
+	p[0] = v >> 8; p[1] = v;
+}
+
+static void put32(u8_t *p, u32_t v) {
+	put16(p, v >> 16); put16(p + 2, v);
+}
+
+static u16_t get16(const u8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static u32_t get32(const u8_t *p) {
+	return ((u32_t) get16(p) << 16) | get16(p + 2);
+}
+
+/*---------------------------------------------------------------------------*/
+static FILE *capture_open(const char *path, int latency, char *aeskey, char *aesiv, char *fmtpstr, bool lazy_decode) {
+	u8_t header[CAPTURE_HEADER];
+	size_t len = fmtpstr ? strlen(fmtpstr) : 0;
+	FILE *file = fopen(path, "wb");
+
+	if (!file) {
+		LOG_WARN("cannot open capture %s", path);
+		return NULL;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 4);
+	put16(header + 4, CAPTURE_VERSION);
+	put32(header + 6, latency);
+	header[10] = lazy_decode;
+	header[11] = aeskey && aesiv;
+	if (header[11]) {
+		memcpy(header + 12, aeskey, 16);
+		memcpy(header + 28, aesiv, 16);
+	}
+	put16(header + 44, len);
+
+	fwrite(header, sizeof(header), 1, file);
+	if (len) fwrite(fmtpstr, len, 1, file);
+	LOG_INFO("capturing to %s", path);
+
+	return file;
+}
+
+/*---------------------------------------------------------------------------*/
+static void capture_write(rtp_t *ctx, int source, const void *data, size_t len) {
+	u8_t header[CAPTURE_RECORD_HDR];
+	u64_t now = rtp_time(ctx);
+
+	put32(header, now >> 32);
+	put32(header + 4, now);
+	header[8] = source;
+	put16(header + 9, len);
+
+	pthread_mutex_lock(&ctx->capture_mutex);
+	fwrite(header, sizeof(header), 1, ctx->capture);
+	fwrite(data, len, 1, ctx->capture);
+	pthread_mutex_unlock(&ctx->capture_mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void capture_event(rtp_t *ctx, int source, seq_t seqno, u32_t rtptime) {
+	u8_t data[6];
+
+	if (!ctx->capture) return;
+
+	put16(data, seqno);
+	put32(data + 2, rtptime);
+	capture_write(ctx, source, data, sizeof(data));
+}
+
+/*---------------------------------------------------------------------------*/
+static void replay_dispatch(rtp_t *ctx, u64_t time, int source, char *packet, size_t len) {
+	ctx->replay_now = time;
+
+	if (source <= TIMING) {
+		if (len >= 2) rtp_process(ctx, source, packet, len);
+	} else if (len == 6) {
+		seq_t seqno = get16((u8_t*) packet);
+		u32_t rtptime = get32((u8_t*) packet + 2);
+		if (source == CAPTURE_RECORD) rtp_record(ctx, seqno, rtptime);
+		else if (source == CAPTURE_FLUSH) rtp_flush(ctx, seqno, rtptime, false);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void replay_wait(u64_t time, u64_t first, u64_t start) {
+	s64_t wait = (s64_t) (time - first) - (s64_t) (gettime_us() - start);
+	if (wait > 0) usleep(wait);
+}
+
+/*---------------------------------------------------------------------------*/
+// runs a capture through the same path as live packets, on its own recorded
+// clock so that two replays of one file decide alike; with realtime it is
+// also paced like the original, for whatever consumes data_cb. With channel,
+// records go through it first, and it answers resend requests
+bool rtp_replay(const char *path, bool realtime, const rtp_channel_t *channel,
+				raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb) {
+	u8_t header[CAPTURE_HEADER], record[CAPTURE_RECORD_HDR];
+	char fmtp[256], *packet, *delivered;
+	u64_t time, at, first = 0, start = gettime_us();
+	u32_t count = 0, dropped = 0;
+	raop_stats_t stats;
+	rtp_t *ctx;
+	FILE *file = fopen(path, "rb");
+	u16_t len;
+	size_t size;
+	int source, from;
+
+	if (!file) {
+		LOG_ERROR("cannot open %s", path);
+		return false;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, CAPTURE_MAGIC, 4) ||
+		get16(header + 4) != CAPTURE_VERSION || (len = get16(header + 44)) >= sizeof(fmtp) ||
+		(len && fread(fmtp, len, 1, file) != 1)) {
+		LOG_ERROR("%s is not a capture", path);
+		fclose(file);
+		return false;
+	}
+
+	fmtp[len] = '\0';
+	ctx = (rtp_t*) calloc(1, sizeof(rtp_t));
+	packet = (char*) malloc(MAX_PACKET);
+	// resends come back with 4 more bytes
+	delivered = (char*) malloc(MAX_PACKET + 4);
+
+	if (ctx) {
+		ctx->replay = true;
+		ctx->channel = channel;
+	}
+	if (!ctx || !packet || !delivered || !rtp_setup(ctx, get32(header + 6),
+									  header[11] ? (char*) header + 12 : NULL, header[11] ? (char*) header + 28 : NULL,
+									  fmtp, NULL, 0, header[10], cmd_cb, data_cb)) {
+		LOG_ERROR("cannot replay %s", path);
+		if (ctx) rtp_end(ctx);
+		free(packet);
+		free(delivered);
+		fclose(file);
+		return false;
+	}
+
+	while (fread(record, sizeof(record), 1, file) == 1) {
+		time = ((u64_t) get32(record) << 32) | get32(record + 4);
+		source = record[8];
+
+		len = get16(record + 9);
+		if (len > MAX_PACKET || (len && fread(packet, len, 1, file) != 1)) {
+			LOG_WARN("[%p]: %s truncated after %u records", ctx, path, count);
+			break;
+		}
+
+		if (!count++) first = time;
+
+		if (channel) {
+			// the resends of the capture answer the live requests, the channel
+			// answers those of this replay
+			if (source == CONTROL && len >= 2 && (packet[1] & 0x7f) == 0x56) {
+				dropped++;
+				continue;
+			}
+
+			// deliver what is due by now, then send this one
+			while (channel->deliver(channel->arg, time, &at, &from, delivered, MAX_PACKET + 4, &size)) {
+				if (realtime) replay_wait(at, first, start);
+				replay_dispatch(ctx, at, from, delivered, size);
+			}
+			channel->send(channel->arg, time, source, packet, len);
+		} else {
+			if (realtime) replay_wait(time, first, start);
+			replay_dispatch(ctx, time, source, packet, len);
+		}
+	}
+
+	if (channel) {
+		while (channel->deliver(channel->arg, UINT64_MAX, &at, &from, delivered, MAX_PACKET + 4, &size)) {
+			if (realtime) replay_wait(at, first, start);
+			replay_dispatch(ctx, at, from, delivered, size);
+		}
+	}
+
+	rtp_get_stats(ctx, &stats);
+	LOG_INFO("[%p]: replayed %u records of %s (%u captured resends dropped), silent %u, discarded %u, "
+			 "recovered %u/%u requested, expired %u, arrival to playtime %u ms avg, %d ms min", ctx, count, path,
+			 dropped, stats.silent_frames, stats.discarded, stats.frames_recovered, stats.frames_requested,
+			 stats.frames_expired, stats.playout_us / 1000, stats.playout_min_us / 1000);
+	cmd_cb(RAOP_STATS, &stats);
+
+	rtp_end(ctx);
+	free(packet);
+	free(delivered);
+	fclose(file);
+
+	return true;
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 // the sequence numbers will wrap pretty often.
 // this returns true if the second arg is after the first
@@ -408,35 +900,158 @@ static int seq_order(seq_t a, seq_t b) {
 }
 
 /*---------------------------------------------------------------------------*/
-static void alac_decode(rtp_t *ctx, s16_t *dest, char *buf, int len, u16_t *outsize) {
-	unsigned char iv[16];
-	int aeslen;
-	assert(len<=MAX_PACKET);
+// chunks for every slot to hold a frame LAZY_RATIO % of its PCM size
+static size_t chunks_count(u32_t slots, int frame_size) {
+	size_t frame_bytes = (frame_size * 4 * LAZY_RATIO) / 100;
+	return (slots * frame_bytes + LAZY_CHUNK - 1) / LAZY_CHUNK;
+}
 
-	if (ctx->decrypt) {
-		aeslen = len & ~0xf;
-		memcpy(iv, ctx->aesiv, sizeof(iv));
-#ifdef WIN32
-		AES_cbc_encrypt((unsigned char*)buf, ctx->decrypt_buf, aeslen, &ctx->aes, iv, AES_DECRYPT);
-#else
-		mbedtls_aes_crypt_cbc(&ctx->aes, MBEDTLS_AES_DECRYPT, aeslen, iv, (unsigned char*) buf, ctx->decrypt_buf);
-#endif
-		memcpy(ctx->decrypt_buf+aeslen, buf+aeslen, len-aeslen);
-		alac_to_pcm(ctx->alac_codec, (unsigned char*) ctx->decrypt_buf, (unsigned char*) dest, 2, (unsigned int*) outsize);
-	} else {
-		alac_to_pcm(ctx->alac_codec, (unsigned char*) buf, (unsigned char*) dest, 2, (unsigned int*) outsize);
+/*---------------------------------------------------------------------------*/
+// the pool is carved from the sink's buffer, chunks first then the free stack
+static void chunks_alloc(rtp_t *ctx, uint8_t *buf, size_t buf_size) {
+	size_t count = buf ? buf_size / (LAZY_CHUNK + sizeof(u16_t)) : 0;
+	size_t min_count = chunks_count(ctx->buffer_frames, ctx->frame_size);
+
+	if (count > 0xffff) count = 0xffff;
+
+	if (count < min_count) {
+		count = min_count;
+		buf = (uint8_t*) malloc(count * (LAZY_CHUNK + sizeof(u16_t)));
+		ctx->chunks.allocated = true;
+	}
+
+	ctx->chunks.packet = (u8_t*) malloc(MAX_PACKET);
+	ctx->chunks.pool = buf;
+	if (!buf) return;
+
+	ctx->chunks.free = (u16_t*) (buf + count * LAZY_CHUNK);
+	ctx->chunks.count = ctx->chunks.top = count;
+	for (size_t i = 0; i < count; i++) ctx->chunks.free[i] = i;
+
+	LOG_INFO("allocated %u chunks of %d bytes for %u lazy buffers", ctx->chunks.count, LAZY_CHUNK, ctx->buffer_frames);
+}
+
+/*---------------------------------------------------------------------------*/
+static void chunks_release(rtp_t *ctx) {
+	if (ctx->chunks.allocated) free(ctx->chunks.pool);
+	if (ctx->chunks.packet) free(ctx->chunks.packet);
+}
+
+/*---------------------------------------------------------------------------*/
+static void chunks_put(rtp_t *ctx, u32_t idx) {
+	abuf_t *abuf = ctx->audio_buffer + idx;
+
+	while (abuf->chunks) ctx->chunks.free[ctx->chunks.top++] = abuf->chunk[--abuf->chunks];
+	BIT_CLEAR(ctx->ab_held, idx);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool chunks_store(rtp_t *ctx, u32_t idx, const u8_t *data, int len) {
+	abuf_t *abuf = ctx->audio_buffer + idx;
+	int i, needed = (len + LAZY_CHUNK - 1) / LAZY_CHUNK;
+
+	chunks_put(ctx, idx);
+
+	// flushes leave stale frames holding chunks until their slot is reused, so
+	// only when the pool runs dry do we sweep them all back, a word at a time
+	// through the slots that hold chunks but are not ready
+	if (ctx->chunks.top < needed) {
+		for (u32_t w = 0; w < ctx->buffer_frames / 32; w++) {
+			for (u32_t stale = ctx->ab_held[w] & ~ctx->ab_ready[w]; stale; stale &= stale - 1) {
+				chunks_put(ctx, (w << 5) + __builtin_ctz(stale));
+			}
+		}
+		if (ctx->chunks.top < needed) return false;
 	}
 
+	for (i = 0; i < needed; i++, data += LAZY_CHUNK, len -= LAZY_CHUNK) {
+		abuf->chunk[i] = ctx->chunks.free[--ctx->chunks.top];
+		memcpy(ctx->chunks.pool + abuf->chunk[i] * LAZY_CHUNK, data, min(len, LAZY_CHUNK));
+	}
+
+	abuf->chunks = needed;
+	BIT_SET(ctx->ab_held, idx);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// a frame leaves the buffer, played or discarded
+static void buffer_drop(rtp_t *ctx, u32_t idx) {
+	BIT_CLEAR(ctx->ab_ready, idx);
+	if (ctx->lazy) chunks_put(ctx, idx);
+}
+
+/*---------------------------------------------------------------------------*/
+static void alac_decode(rtp_t *ctx, s16_t *dest, u8_t *buf, int len, unsigned *outsize) {
+	alac_to_pcm(ctx->alac_codec, (unsigned char*) buf, (unsigned char*) dest, 2, outsize);
 	*outsize *= 4;
 }
 
+/*---------------------------------------------------------------------------*/
+// hand a ready frame to the sink. In lazy mode it is decoded first, with
+// ab_mutex released as in buffer_put_packet(): false when the stream was
+// flushed meanwhile, the frame is then dropped and nothing more is played
+static bool buffer_play(rtp_t *ctx, u32_t idx, u64_t playtime) {
+	abuf_t *abuf = ctx->audio_buffer + idx;
+
+	if (ctx->lazy) {
+		unsigned pcm_len;
+		int i, len = abuf->len;
+		u32_t flushes = ctx->flushes;
+
+		for (i = 0; i < abuf->chunks; i++) {
+			memcpy(ctx->chunks.packet + i * LAZY_CHUNK, ctx->chunks.pool + abuf->chunk[i] * LAZY_CHUNK,
+				   min(len - i * LAZY_CHUNK, LAZY_CHUNK));
+		}
+		buffer_drop(ctx, idx);
+
+		pthread_mutex_unlock(&ctx->ab_mutex);
+		alac_decode(ctx, ctx->decode_buf, ctx->chunks.packet, len, &pcm_len);
+		pthread_mutex_lock(&ctx->ab_mutex);
+
+		if (flushes != ctx->flushes || ctx->state != RTP_PLAY) return false;
+		plc_received(&ctx->plc, ctx->decode_buf, pcm_len / 4);
+		ctx->data_cb((const u8_t*) ctx->decode_buf, pcm_len, playtime);
+	} else {
+		plc_received(&ctx->plc, abuf->data, abuf->len / 4);
+		ctx->data_cb((const u8_t*) abuf->data, abuf->len, playtime);
+		buffer_drop(ctx, idx);
+	}
+
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+// whether buffer_put_packet would keep this packet, as of now (under ab_mutex),
+// so that what is below a flush or already too late is not decoded for nothing
+static bool buffer_wanted(rtp_t *ctx, seq_t seqno) {
+	if (ctx->first_seqno != -1 && seq_order(seqno, ctx->first_seqno)) return false;
+	if (ctx->state == RTP_WAIT) return true;
+	return seqno == (seq_t) (ctx->ab_write + 1) || seq_order(ctx->ab_write, seqno) || seq_order(ctx->ab_read, seqno + 1);
+}
 
 /*---------------------------------------------------------------------------*/
-static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool first, char *data, int len) {
+// data is the payload already decrypted (in place)
+static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool first, bool resent, char *data, int len) {
 	abuf_t *abuf = NULL;
+	u32_t idx = BUFIDX(ctx, seqno);
+	unsigned pcm_len;
+	u8_t *clear = (u8_t*) data;
+	bool decoded = false;
 
 	pthread_mutex_lock(&ctx->ab_mutex);
 
+	// decode with the lock released so that flush and sync never wait on ALAC,
+	// or not at all in lazy mode where frames are decoded when played. A flush
+	// in the meantime is caught by the checks below, which then drop it
+	if (!ctx->lazy && buffer_wanted(ctx, seqno)) {
+		pthread_mutex_unlock(&ctx->ab_mutex);
+		alac_decode(ctx, ctx->decode_buf, clear, len, &pcm_len);
+		decoded = true;
+		pthread_mutex_lock(&ctx->ab_mutex);
+	}
+
     /* if we have received a RECORD with a seqno, then this is the first allowed rtp sequence number
 	 * and we are in RTP_WAIT state. If seqno was 0, then we are waiting for a flush that will tell
 	 * us what should be our first allowed packet but we must accept everything, wait and clean when
@@ -454,11 +1069,15 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 		ctx->ab_write = seqno - 1;
 		ctx->ab_read = ctx->ab_write + 1;
         ctx->resent_req = ctx->resent_rec = ctx->silent_frames = ctx->discarded = 0;
+		ctx->nack.requests = ctx->nack.expired = 0;
+		ctx->plc_cycles = 0;
+		ctx->arrival.waits = 0;
+		ctx->arrival.wait_sum = 0;
 		if (ctx->first_seqno != -1) {
         	LOG_INFO("[%p]: 1st accepted packet:%d, now playing", ctx, seqno);
 			ctx->state = RTP_PLAY;
 			ctx->first_seqno = -1;
-            u32_t playtime = ctx->synchro.time + ((rtptime - ctx->synchro.rtp) * 10) / (RAOP_SAMPLE_RATE / 100);
+            u64_t playtime = PLAYTIME(ctx, rtptime);
             ctx->cmd_cb(RAOP_PLAY, playtime);
 		} else {
             ctx->state = RTP_STREAM;
@@ -467,18 +1086,19 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 	} else if (ctx->state == RTP_STREAM && ctx->first_seqno != -1 && seq_order(ctx->first_seqno, seqno + 1)) {
 		// now we're talking, but first discard all packets with a seqno below first_seqno AND not ready
 		while (seq_order(ctx->ab_read, ctx->first_seqno) ||
-			!ctx->audio_buffer[BUFIDX(ctx->ab_read)].ready) {
-			ctx->audio_buffer[BUFIDX(ctx->ab_read)].ready = false;
+			!ABUF_READY(ctx, BUFIDX(ctx, ctx->ab_read))) {
+			buffer_drop(ctx, BUFIDX(ctx, ctx->ab_read));
 			ctx->ab_read++;
 		}
         LOG_INFO("[%p]: done waiting for FLUSH with packet:%d, now playing starting:%hu", ctx, seqno, ctx->ab_read);
 		ctx->state = RTP_PLAY;
 		ctx->first_seqno = -1;
-        u32_t playtime = ctx->synchro.time + ((rtptime - ctx->synchro.rtp) * 10) / (RAOP_SAMPLE_RATE / 100);
+        u64_t playtime = PLAYTIME(ctx, rtptime);
 		ctx->cmd_cb(RAOP_PLAY, playtime);
 	}
 
-    abuf = ctx->audio_buffer + BUFIDX(seqno);
+	arrival_hist(ctx, rtptime, rtp_time(ctx));
+    abuf = ctx->audio_buffer + idx;
 
 	if (seqno == (u16_t) (ctx->ab_write+1)) {
 		// expected packet
@@ -492,27 +1112,33 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
             ctx->ab_read = seqno;
 		} else {
             // request re-send missed frames and evaluate resent date as a whole *after*
-            if (ctx->state == RTP_PLAY) rtp_request_resend(ctx, ctx->ab_write + 1, seqno-1);
+            bool requested = ctx->state == RTP_PLAY && rtp_request_resend(ctx, ctx->ab_write + 1, seqno-1);
+            if (requested) ctx->resent_req += (seq_t) (seqno - ctx->ab_write - 1);
 
             // resend date is after all requests have been sent
-            u32_t now = gettime_ms();
+            u32_t now = rtp_time(ctx) / 1000;
 
             // set expected timing of missed frames for buffer_push_packet and set last_resend date
             for (seq_t i = ctx->ab_write + 1; seq_order(i, seqno); i++) {
-                ctx->audio_buffer[BUFIDX(i)].rtptime = rtptime - (seqno-i)*ctx->frame_size;
-                ctx->audio_buffer[BUFIDX(i)].last_resend = now;
+                ctx->ab_rtptime[BUFIDX(ctx, i)] = rtptime - (seqno-i)*ctx->frame_size;
+                ctx->ab_resend[BUFIDX(ctx, i)] = now;
+                ctx->ab_nacks[BUFIDX(ctx, i)] = requested;
             }
             LOG_DEBUG("[%p]: packet newer seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
         }
 
 		ctx->ab_write = seqno;
 	} else if (seq_order(ctx->ab_read, seqno + 1)) {
-		// recovered packet, not yet sent
-		ctx->resent_rec++;
+		// recovered packet, not yet sent: only an answer to a request counts,
+		// and one coming back sooner than the round trip allows is not
+		if (resent && ctx->ab_nacks[idx] && !ABUF_READY(ctx, idx) &&
+			(u32_t) (rtp_time(ctx) / 1000) - ctx->ab_resend[idx] >= (ctx->nack.srtt >> 3) / 2) {
+			ctx->resent_rec++;
+		}
 		LOG_DEBUG("[%p]: packet recovered seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
 	} else {
         // too late
-		if (abuf->missed) LOG_INFO("[%p]: packet too late seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
+		if (BIT_TEST(ctx->ab_missed, idx)) LOG_INFO("[%p]: packet too late seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
         abuf = NULL;
 	}
 
@@ -521,18 +1147,28 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 		ctx->in_frames = 0;
 	}
 
+	// buffer_wanted() said otherwise, nothing to store
+	if (abuf && !ctx->lazy && !decoded) abuf = NULL;
+
+	if (abuf && ctx->lazy && !chunks_store(ctx, idx, clear, len)) {
+		LOG_WARN("[%p]: lazy buffer pool exhausted, dropping seqno:%hu", ctx, seqno);
+		ctx->discarded++;
+		abuf = NULL;
+	}
+
 	if (abuf) {
-		alac_decode(ctx, abuf->data, data, len, &abuf->len);
-		abuf->ready = 1;
-        abuf->missed = 0;
+		if (ctx->lazy) {
+			abuf->len = len;
+		} else {
+			memcpy(abuf->data, ctx->decode_buf, pcm_len);
+			abuf->len = pcm_len;
+		}
+		BIT_SET(ctx->ab_ready, idx);
+		BIT_CLEAR(ctx->ab_missed, idx);
 		// this is the local rtptime when this frame is expected to play
-		abuf->rtptime = rtptime;
+		ctx->ab_rtptime[idx] = rtptime;
+		arrival_wait(ctx, rtptime, rtp_time(ctx));
 		buffer_push_packet(ctx);
-
-#ifdef __RTP_STORE
-		fwrite(data, len, 1, ctx->rtpIN);
-		fwrite(abuf->data, abuf->len, 1, ctx->rtpOUT);
-#endif
 	}
 
 	pthread_mutex_unlock(&ctx->ab_mutex);
@@ -541,8 +1177,8 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 /*---------------------------------------------------------------------------*/
 // push as many frames as possible through callback
 static void buffer_push_packet(rtp_t *ctx) {
-	abuf_t *curframe = NULL;
-	u32_t now, playtime, hold = max((ctx->latency * 1000) / (8 * RAOP_SAMPLE_RATE), 100);
+	u32_t curframe = 0;
+	u64_t now, playtime, hold = max(((u64_t) ctx->latency * 1000000) / (8 * RAOP_SAMPLE_RATE), (u64_t) 100000);
 
 	// not ready to play yet
 	if (ctx->state != RTP_PLAY || ctx->synchro.status != (RTP_SYNC | NTP_SYNC)) return;
@@ -550,29 +1186,35 @@ static void buffer_push_packet(rtp_t *ctx) {
 	// there is always at least one frame in the buffer
 	do {
 		// re-evaluate time in loop in case data callback blocks ...
-		now = gettime_ms();
+		now = rtp_time(ctx);
 
-		// try to manage playtime so that we overflow as late as possible if we miss NTP (2^31 / 10 / 44100)
-		curframe = ctx->audio_buffer + BUFIDX(ctx->ab_read);
-		playtime = ctx->synchro.time + ((curframe->rtptime - ctx->synchro.rtp) * 10) / (RAOP_SAMPLE_RATE / 100);
+		curframe = BUFIDX(ctx, ctx->ab_read);
+		playtime = PLAYTIME(ctx, ctx->ab_rtptime[curframe]);
 
 		if (now > playtime) {
-			LOG_DEBUG("[%p]: discarded frame now:%u missed by:%d (W:%hu R:%hu)", ctx, now, now - playtime, ctx->ab_write, ctx->ab_read);
+			LOG_DEBUG("[%p]: discarded frame now:%llu missed by:%lld us (W:%hu R:%hu)", ctx, now, (s64_t) (now - playtime), ctx->ab_write, ctx->ab_read);
 			ctx->discarded++;
-			curframe->ready = 0;
+			if (!ABUF_READY(ctx, curframe)) nack_expire(ctx, curframe);
+			buffer_drop(ctx, curframe);
 		} else if (playtime - now <= hold) {
-			if (curframe->ready) {
-				ctx->data_cb((const u8_t*) curframe->data, curframe->len, playtime);
-				curframe->ready = 0;
+			if (ABUF_READY(ctx, curframe)) {
+				if (!buffer_play(ctx, curframe, playtime)) return;
 			} else {
-				LOG_DEBUG("[%p]: created zero frame (W:%hu R:%hu)", ctx, ctx->ab_write, ctx->ab_read);
-				ctx->data_cb(silence_frame, ctx->frame_size * 4, playtime);
+#ifndef WIN32
+				u32_t cycles = esp_cpu_get_cycle_count();
+#endif
+				const s16_t *frame = plc_conceal(&ctx->plc);
+#ifndef WIN32
+				ctx->plc_cycles += esp_cpu_get_cycle_count() - cycles;
+#endif
+				LOG_DEBUG("[%p]: concealed missing frame (W:%hu R:%hu)", ctx, ctx->ab_write, ctx->ab_read);
+				ctx->data_cb((const u8_t*) frame, ctx->frame_size * 4, playtime);
 				ctx->silent_frames++;
-                curframe->missed = 1;
+                BIT_SET(ctx->ab_missed, curframe);
+				nack_expire(ctx, curframe);
 			}
-		} else if (curframe->ready) {
-			ctx->data_cb((const u8_t*) curframe->data, curframe->len, playtime);
-			curframe->ready = 0;
+		} else if (ABUF_READY(ctx, curframe)) {
+			if (!buffer_play(ctx, curframe, playtime)) return;
 		} else {
 			break;
 		}
@@ -583,33 +1225,270 @@ static void buffer_push_packet(rtp_t *ctx) {
 	} while (seq_order(ctx->ab_read, ctx->ab_write));
 
 	if (ctx->out_frames > 1000) {
-		LOG_INFO("[%p]: drain [level:%hd head:%d ms] [W:%hu R:%hu] [req:%u sil:%u dis:%u]",
-				ctx, ctx->ab_write - ctx->ab_read, playtime - now, ctx->ab_write, ctx->ab_read,
-				ctx->resent_req, ctx->silent_frames, ctx->discarded);
+		raop_stats_t stats;
+		rtp_get_stats(ctx, &stats);
+		LOG_INFO("[%p]: drain [level:%hd head:%d ms] [W:%hu R:%hu] [req:%u rec:%u exp:%u rtt:%u sil:%u dis:%u jit:%u us]",
+				ctx, ctx->ab_write - ctx->ab_read, (int) ((s64_t) (playtime - now) / 1000), ctx->ab_write, ctx->ab_read,
+				ctx->resent_req, ctx->resent_rec, ctx->nack.expired, ctx->nack.srtt >> 3, ctx->silent_frames, ctx->discarded,
+				stats.jitter_us);
 		ctx->out_frames = 0;
+		ctx->cmd_cb(RAOP_STATS, &stats);
 	}
 
-	LOG_SDEBUG("playtime %u %d [W:%hu R:%hu] %d", playtime, playtime - now, ctx->ab_write, ctx->ab_read, curframe->ready);
+	LOG_SDEBUG("playtime %llu %lld [W:%hu R:%hu] %d", playtime, (s64_t) (playtime - now), ctx->ab_write, ctx->ab_read, ABUF_READY(ctx, curframe) != 0);
 
-    // try to request resend missing packet in order, explore up to 32 frames
-    for (int step = max((ctx->ab_write - ctx->ab_read + 1) / 32, 1),
-         i = 0, first = 0;
-         seq_order(ctx->ab_read + i, ctx->ab_write); i += step) {
+	nack_schedule(ctx, rtp_time(ctx), hold);
+}
 
-        abuf_t* frame = ctx->audio_buffer + BUFIDX(ctx->ab_read + i);
+/*---------------------------------------------------------------------------*/
+// RFC 6298 smoothing of the NTP round trip, which is what a resend costs
+static void nack_update_rtt(rtp_t *ctx, u32_t rtt) {
+	if (!ctx->nack.srtt) {
+		ctx->nack.srtt = max(rtt, 1) << 3;
+		ctx->nack.rttvar = rtt << 1;
+	} else {
+		s32_t err = rtt - (ctx->nack.srtt >> 3);
+		ctx->nack.srtt += err;
+		ctx->nack.rttvar += abs(err) - (ctx->nack.rttvar >> 2);
+	}
+}
 
-        // stop when we reach a ready frame or a recent pending resend
-        if (first && (frame->ready || now - frame->last_resend <= RESEND_TO)) {
-            if (!rtp_request_resend(ctx, first, ctx->ab_read + i - 1)) break;
-            first = 0;
-            i += step - 1;
-        } else if (!frame->ready && now - frame->last_resend > RESEND_TO) {
-            if (!first) first = ctx->ab_read + i;
-            frame->last_resend = now;
-        }
-    }
+/*---------------------------------------------------------------------------*/
+static u32_t nack_timeout(rtp_t *ctx) {
+	if (!ctx->nack.srtt) return RESEND_TO;
+	return min(max((ctx->nack.srtt >> 3) + ctx->nack.rttvar, RESEND_MIN), RESEND_TO);
+}
+
+/*---------------------------------------------------------------------------*/
+// merged ranges may hold received frames, only the missing ones are counted
+static void nack_send(rtp_t *ctx, seq_t first, seq_t last, u32_t now) {
+	u32_t missing = 0;
+
+	for (seq_t i = first; seq_order(i, last + 1); i++) {
+		u32_t idx = BUFIDX(ctx, i);
+		if (ABUF_READY(ctx, idx)) continue;
+		ctx->ab_resend[idx] = now;
+		ctx->ab_nacks[idx]++;
+		missing++;
+	}
+	if (rtp_request_resend(ctx, first, last)) ctx->resent_req += missing;
+}
+
+/*---------------------------------------------------------------------------*/
+// a frame concealed or dropped while missing: expired if it was asked for
+static void nack_expire(rtp_t *ctx, u32_t idx) {
+	if (ctx->ab_nacks[idx]) ctx->nack.expired++;
+	ctx->ab_nacks[idx] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// walk every missing frame and ask again for those whose last request is older
+// than the retransmission timeout, doubled per request already made, as long
+// as an answer can still arrive before the frame is due (it is concealed hold
+// µs before its playtime) and NACK_RETRIES are not reached
+static void nack_schedule(rtp_t *ctx, u64_t now_us, u64_t hold) {
+	u32_t rto = nack_timeout(ctx), rtt = ctx->nack.srtt >> 3;
+	u32_t now = now_us / 1000;
+	seq_t first = 0, last = 0;
+	bool pending = false;
+
+	if (ctx->state != RTP_PLAY || now - ctx->nack.last_scan < NACK_TICK) return;
+	ctx->nack.last_scan = now;
+
+	// drained, read is one past write and [read, write) would be the whole seqno space
+	if (!seq_order(ctx->ab_read, ctx->ab_write)) return;
+
+#ifndef WIN32
+	u32_t cycles = esp_cpu_get_cycle_count();
+#endif
+
+	// received frames are skipped 32 at a time through the ready bitmap
+	for (seq_t i = buffer_next_gap(ctx, ctx->ab_read, ctx->ab_write); i != ctx->ab_write;
+		 i = buffer_next_gap(ctx, i + 1, ctx->ab_write)) {
+		u32_t idx = BUFIDX(ctx, i), nacks = ctx->ab_nacks[idx];
+
+		if (nacks >= NACK_RETRIES) continue;
+		if (now - ctx->ab_resend[idx] < rto << (nacks ? nacks - 1 : 0)) continue;
+		if ((s64_t) (PLAYTIME(ctx, ctx->ab_rtptime[idx]) - hold - now_us) < (s64_t) rtt * 1000) continue;
+
+		if (pending && (seq_t) (i - last) <= NACK_MERGE + 1) {
+			last = i;
+		} else {
+			if (pending) nack_send(ctx, first, last, now);
+			first = last = i;
+			pending = true;
+		}
+	}
+
+	if (pending) nack_send(ctx, first, last, now);
+
+#ifndef WIN32
+	ctx->nack.scan_cycles += esp_cpu_get_cycle_count() - cycles;
+	ctx->nack.scans++;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_get_stats(rtp_t *ctx, raop_stats_t *stats) {
+	stats->nack_requests = ctx->nack.requests;
+	stats->frames_requested = ctx->resent_req;
+	stats->frames_recovered = ctx->resent_rec;
+	stats->frames_expired = ctx->nack.expired;
+	stats->rtt_ms = ctx->nack.srtt >> 3;
+	stats->silent_frames = ctx->silent_frames;
+	stats->discarded = ctx->discarded;
+	stats->clock_skew_ppm = clock_sync_ppm(&ctx->clock);
+	stats->jitter_us = (u64_t) (ctx->arrival.jitter >> 4) * 1000000 / RAOP_SAMPLE_RATE;
+	memcpy(stats->lead_hist, ctx->arrival.lead, sizeof(stats->lead_hist));
+	memcpy(stats->depth_hist, ctx->arrival.depth, sizeof(stats->depth_hist));
+	stats->playout_us = ctx->arrival.wait_sum > 0 ? ctx->arrival.wait_sum / ctx->arrival.waits : 0;
+	stats->playout_min_us = ctx->arrival.waits ? ctx->arrival.wait_min : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int hist_bin(s64_t permille) {
+	static const s32_t edges[RAOP_HIST_BINS - 1] = RAOP_HIST_EDGES;
+	int i = 0;
+
+	while (i < RAOP_HIST_BINS - 1 && permille >= edges[i]) i++;
+	return i;
+}
+
+/*---------------------------------------------------------------------------*/
+// audio packets only, resends say nothing of the path
+static void arrival_update(rtp_t *ctx, u32_t rtptime, u64_t now) {
+	// RFC 3550 A.8, with transit times in samples
+	s32_t transit = (s32_t) ((u32_t) (now * RAOP_SAMPLE_RATE / 1000000) - rtptime);
+
+	if (ctx->arrival.primed) {
+		s32_t d = transit - ctx->arrival.transit;
+		if (d < 0) d = -d;
+		ctx->arrival.jitter += d - ((ctx->arrival.jitter + 8) >> 4);
+	}
+	ctx->arrival.transit = transit;
+	ctx->arrival.primed = true;
+}
+
+/*---------------------------------------------------------------------------*/
+// with ab_mutex held, for each audio packet reaching the jitter buffer: the
+// time left to its playtime and the audio held ahead of it, per mille of the
+// latency. Held frames run from ab_read to ab_write, none when drained
+static void arrival_hist(rtp_t *ctx, u32_t rtptime, u64_t now) {
+	u32_t held = (seq_t) (ctx->ab_write + 1 - ctx->ab_read);
+	s64_t lead;
+
+	if (ctx->state != RTP_PLAY || ctx->synchro.status != (RTP_SYNC | NTP_SYNC) || !ctx->latency) return;
+
+	lead = (s64_t) (PLAYTIME(ctx, rtptime) - now);
+	ctx->arrival.lead[hist_bin(lead * RAOP_SAMPLE_RATE / 1000 / ctx->latency)]++;
+	ctx->arrival.depth[hist_bin((s64_t) held * ctx->frame_size * 1000 / ctx->latency)]++;
+}
+
+/*---------------------------------------------------------------------------*/
+// with ab_mutex held, for each frame placed in the jitter buffer: how long it
+// waits there, from its arrival to its playtime, is the latency achieved
+static void arrival_wait(rtp_t *ctx, u32_t rtptime, u64_t now) {
+	s64_t wait;
+
+	if (ctx->state != RTP_PLAY || ctx->synchro.status != (RTP_SYNC | NTP_SYNC)) return;
+
+	wait = (s64_t) (PLAYTIME(ctx, rtptime) - now);
+	if (!ctx->arrival.waits || wait < ctx->arrival.wait_min) ctx->arrival.wait_min = wait;
+	ctx->arrival.wait_sum += wait;
+	ctx->arrival.waits++;
+}
+
+
+/*---------------------------------------------------------------------------*/
+#ifndef WIN32
+static bool decoder_start(rtp_t *ctx, BaseType_t core_id) {
+	int i;
+
+	ctx->decoder.slots = (rtp_packet_t*) heap_caps_malloc(DECODE_SLOTS * sizeof(rtp_packet_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	ctx->decoder.free = xQueueCreate(DECODE_SLOTS, sizeof(rtp_packet_t*));
+	ctx->decoder.ready = xQueueCreate(DECODE_SLOTS, sizeof(rtp_packet_t*));
+	if (!ctx->decoder.slots || !ctx->decoder.free || !ctx->decoder.ready) return false;
+
+	for (i = 0; i < DECODE_SLOTS; i++) {
+		rtp_packet_t *slot = ctx->decoder.slots + i;
+		xQueueSend(ctx->decoder.free, &slot, 0);
+	}
+
+	// below the RTP thread so that intake always wins during bursts
+	if (core_id != tskNO_AFFINITY && portNUM_PROCESSORS > 1) core_id = !core_id;
+	if (xTaskCreatePinnedToCore(decoder_func, "RTP_decode", DECODE_STACK_SIZE, ctx,
+								CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT, &ctx->decoder.task, core_id) != pdPASS) {
+		ctx->decoder.task = NULL;
+		return false;
+	}
+
+	return true;
 }
 
+/*---------------------------------------------------------------------------*/
+static void decoder_func(void *arg) {
+	rtp_t *ctx = (rtp_t*) arg;
+	rtp_packet_t *batch[DECODE_BATCH];
+	int i, count;
+
+	while (ctx->running) {
+		// time out so that we see running going down
+		if (xQueueReceive(ctx->decoder.ready, batch, pdMS_TO_TICKS(100)) != pdTRUE) continue;
+
+		// take whatever else is queued, one wakeup for all, and decrypt it in the
+		// slots; the driver takes a buffer per call, so that is one per packet
+		for (count = 1; count < DECODE_BATCH && xQueueReceive(ctx->decoder.ready, batch + count, 0) == pdTRUE; count++);
+
+		if (ctx->decrypt) {
+			u32_t start = esp_cpu_get_cycle_count();
+			for (i = 0; i < count; i++) cipher_decrypt(&ctx->cipher, (u8_t*) batch[i]->data, batch[i]->len);
+			ctx->decoder.crypt_cycles += (u32_t) (esp_cpu_get_cycle_count() - start);
+			ctx->decoder.crypt_packets += count;
+		}
+
+		for (i = 0; i < count; i++) {
+			buffer_put_packet(ctx, batch[i]->seqno, batch[i]->rtptime, batch[i]->first, batch[i]->resent, batch[i]->data,
+								  batch[i]->len);
+			xQueueSend(ctx->decoder.free, batch + i, 0);
+		}
+	}
+
+	LOG_INFO("[%p]: decoder terminating", ctx);
+	xTaskNotifyGive(ctx->joiner);
+	vTaskDelete(NULL);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+// RTP thread side: hand the payload to the decoder, or decode in place if there is none
+static void buffer_queue_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool first, bool resent, char *data, int len) {
+#ifndef WIN32
+	rtp_packet_t *packet;
+
+	if (ctx->decoder.task) {
+		// a dropped packet leaves a hole that is NACKed like a network loss
+		if (xQueueReceive(ctx->decoder.free, &packet, pdMS_TO_TICKS(DECODE_WAIT_MS)) != pdTRUE) {
+			ctx->decoder.dropped++;
+			LOG_WARN("[%p]: decoder queue full, dropping packet:%hu", ctx, seqno);
+			return;
+		}
+
+		packet->seqno = seqno;
+		packet->rtptime = rtptime;
+		packet->first = first;
+		packet->resent = resent;
+		packet->len = len;
+		memcpy(packet->data, data, len);
+		xQueueSend(ctx->decoder.ready, &packet, 0);
+
+		u32_t depth = uxQueueMessagesWaiting(ctx->decoder.ready);
+		if (depth > ctx->decoder.peak) ctx->decoder.peak = depth;
+		return;
+	}
+#endif
+	if (ctx->decrypt) cipher_decrypt(&ctx->cipher, (u8_t*) data, len);
+	buffer_put_packet(ctx, seqno, rtptime, first, resent, data, len);
+}
 
 /*---------------------------------------------------------------------------*/
 #ifdef WIN32
@@ -619,7 +1498,6 @@ static void rtp_thread_func(void *arg) {
 #endif
 	fd_set fds;
 	int i, sock = -1;
-	int count = 0;
 	bool ntp_sent;
 	char *packet = (char *)malloc(MAX_PACKET);
 	rtp_t *ctx = (rtp_t*) arg;
@@ -632,10 +1510,8 @@ static void rtp_thread_func(void *arg) {
 
 	while (ctx->running) {
 		ssize_t plen;
-		char type;
-		socklen_t rtp_client_len = sizeof(struct sockaddr_in);
-		int idx = 0;
-		char *pktp = packet;
+		socklen_t rtp_client_len;
+		int idx, n, received = 0;
 		struct timeval timeout = {0, 100*1000};
 
 		FD_ZERO(&fds);
@@ -646,167 +1522,198 @@ static void rtp_thread_func(void *arg) {
             continue;
         }
 
-		for (i = 0; i < 3; i++)
-			if (FD_ISSET(ctx->rtp_sockets[i].sock, &fds)) idx = i;
-
-		plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, MAX_PACKET, MSG_DONTWAIT, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
-
 		if (!ntp_sent) {
 			LOG_WARN("[%p]: NTP request not send yet", ctx);
 			ntp_sent = rtp_request_timing(ctx);
 		}
 
-		if (plen <= 0) {
-			LOG_WARN("Nothing received on a readable socket %d", plen);
-			continue;
-		}
+		// drain every readable socket, so that resent and timing packets arriving
+		// with audio are not left for the next wakeup (batch caps a flooded socket)
+		for (idx = 0; idx < 3; idx++) {
+			if (!FD_ISSET(ctx->rtp_sockets[idx].sock, &fds)) continue;
 
-		assert(plen <= MAX_PACKET);
-        ctx->stalled = 0;
+			for (n = 0; n < RECV_BATCH; n++) {
+				rtp_client_len = sizeof(struct sockaddr_in);
+				plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, MAX_PACKET, MSG_DONTWAIT, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
 
-		type = packet[1] & ~0x80;
-		pktp = packet;
+				if (plen <= 0) {
+					if (!n) LOG_WARN("Nothing received on a readable socket %d", plen);
+					break;
+				}
 
-		switch (type) {
-			seq_t seqno;
-			unsigned rtptime;
+				assert(plen <= MAX_PACKET);
+				ctx->stalled = 0;
+				received++;
 
-			// re-sent packet
-			case 0x56: {
-				pktp += 4;
-				plen -= 4;
+				rtp_process(ctx, idx, packet, plen);
 			}
-			// fall through
-
-			// data packet
-			case 0x60: {
-				seqno = ntohs(*(u16_t*)(pktp+2));
-				rtptime = ntohl(*(u32_t*)(pktp+4));
+		}
 
-				// adjust pointer and length
-				pktp += 12;
-				plen -= 12;
+		ctx->recv_hist[min(received, RECV_HIST_BINS - 1)]++;
+	}
 
-				LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
+	free(packet);
+	LOG_INFO("[%p]: terminating", ctx);
 
-				// check if packet contains enough content to be reasonable
-				if (plen < 16) break;
+#ifndef WIN32
+	xTaskNotifyGive(ctx->joiner);
+	vTaskSuspend(NULL);
+#else
+	return NULL;
+#endif
+}
 
-				if ((packet[1] & 0x80) && (type != 0x56)) {
-					LOG_INFO("[%p]: 1st audio packet received", ctx);
-				}
+/*---------------------------------------------------------------------------*/
+static void rtp_process(rtp_t *ctx, int source, char *packet, ssize_t plen) {
+	char type = packet[1] & ~0x80;
+	char *pktp = packet;
 
-				buffer_put_packet(ctx, seqno, rtptime, packet[1] & 0x80, pktp, plen);
+#ifdef __RTP_STORE
+	if (ctx->capture) capture_write(ctx, source, packet, plen);
+#endif
 
-				break;
-			}
+	switch (type) {
+		seq_t seqno;
+		unsigned rtptime;
 
-			// sync packet
-			case 0x54: {
-				u32_t rtp_now_latency = ntohl(*(u32_t*)(pktp+4));
-				u64_t remote = (((u64_t) ntohl(*(u32_t*)(pktp+8))) << 32) + ntohl(*(u32_t*)(pktp+12));
-				u32_t rtp_now = ntohl(*(u32_t*)(pktp+16));
-				u16_t flags = ntohs(*(u16_t*)(pktp+2));
-				u32_t remote_gap = NTP2MS(remote - ctx->timing.remote);
-
-				// try to get NTP every 3 sec or every time if we are not synced
-				if (!count-- || !(ctx->synchro.status & NTP_SYNC)) {
-					rtp_request_timing(ctx);
-					count = 3;
-				}
+		// re-sent packet
+		case 0x56: {
+			pktp += 4;
+			plen -= 4;
+		}
+		// fall through
 
-				// something is wrong, we should not have such gap
-				if (remote_gap > 10000) {
-					LOG_WARN("discarding remote timing information %u", remote_gap);
-					break;
-				}
+		// data packet
+		case 0x60: {
+			seqno = ntohs(*(u16_t*)(pktp+2));
+			rtptime = ntohl(*(u32_t*)(pktp+4));
 
-				pthread_mutex_lock(&ctx->ab_mutex);
+			// adjust pointer and length
+			pktp += 12;
+			plen -= 12;
 
-				// re-align timestamp and expected local playback time (and magic 11025 latency)
-				ctx->latency = rtp_now - rtp_now_latency;
-				if (flags == 7 || flags == 4) ctx->latency += 11025;
-				if (ctx->latency < MIN_LATENCY) ctx->latency = MIN_LATENCY;
-				else if (ctx->latency > MAX_LATENCY) ctx->latency = MAX_LATENCY;
-				ctx->synchro.rtp = rtp_now - ctx->latency;
-				ctx->synchro.time = ctx->timing.local + remote_gap;
+			LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
 
-				// now we are synced on RTP frames
-				ctx->synchro.status |= RTP_SYNC;
+			// check if packet contains enough content to be reasonable
+			if (plen < 16) break;
 
-				// 1st sync packet received (signals a restart of playback)
-				if (packet[0] & 0x10) {
-					LOG_INFO("[%p]: 1st sync packet received", ctx);
-				}
+			if ((packet[1] & 0x80) && (type != 0x56)) {
+				LOG_INFO("[%p]: 1st audio packet received", ctx);
+			}
 
-				pthread_mutex_unlock(&ctx->ab_mutex);
+			if (type == 0x60) arrival_update(ctx, rtptime, rtp_time(ctx));
+			buffer_queue_packet(ctx, seqno, rtptime, packet[1] & 0x80, type == 0x56, pktp, plen);
 
-				LOG_DEBUG("[%p]: sync packet latency:%d rtp_latency:%u rtp:%u remote ntp:%llx, local time:%u local rtp:%u (now:%u)",
-						  ctx, ctx->latency, rtp_now_latency, rtp_now, remote, ctx->synchro.time, ctx->synchro.rtp, gettime_ms());
+			break;
+		}
 
-				if ((ctx->synchro.status & RTP_SYNC) && (ctx->synchro.status & NTP_SYNC)) ctx->cmd_cb(RAOP_TIMING);
+		// sync packet
+		case 0x54: {
+			u32_t rtp_now_latency = ntohl(*(u32_t*)(pktp+4));
+			u64_t remote = (((u64_t) ntohl(*(u32_t*)(pktp+8))) << 32) + ntohl(*(u32_t*)(pktp+12));
+			u32_t rtp_now = ntohl(*(u32_t*)(pktp+16));
+			u16_t flags = ntohs(*(u16_t*)(pktp+2));
+			s64_t remote_gap = ntp_to_us(remote) - ntp_to_us(ctx->timing.remote);
+			u64_t playtime = ctx->clock.valid ? clock_sync_to_local(&ctx->clock, remote) : ctx->timing.local + remote_gap;
+
+			// try to get NTP every 3 sec or every time if we are not synced
+			if (!ctx->sync_count-- || !(ctx->synchro.status & NTP_SYNC)) {
+				rtp_request_timing(ctx);
+				ctx->sync_count = 3;
+			}
 
+			// something is wrong, we should not have such gap
+			if (remote_gap < 0 || remote_gap > 10000000) {
+				LOG_WARN("discarding remote timing information %lld us", remote_gap);
 				break;
 			}
 
-			// NTP timing packet
-			case 0x53: {
-				u32_t reference   = ntohl(*(u32_t*)(pktp+12)); // only low 32 bits in our case
-				u64_t remote 	  =(((u64_t) ntohl(*(u32_t*)(pktp+16))) << 32) + ntohl(*(u32_t*)(pktp+20));
-				u32_t roundtrip   = gettime_ms() - reference;
-
-				// better discard sync packets when roundtrip is suspicious
-				if (roundtrip > 100) {
-					// ask for another one only if we are not synced already
-					if (!(ctx->synchro.status & NTP_SYNC)) rtp_request_timing(ctx);
-					LOG_WARN("[%p]: discarding NTP roundtrip of %u ms", ctx, roundtrip);
-					break;
-				}
+			pthread_mutex_lock(&ctx->ab_mutex);
+
+			// re-align timestamp and expected local playback time (and magic 11025 latency)
+			ctx->latency = rtp_now - rtp_now_latency;
+			if (flags == 7 || flags == 4) ctx->latency += 11025;
+			if (ctx->latency < MIN_LATENCY) ctx->latency = MIN_LATENCY;
+			else if (ctx->latency > MAX_LATENCY) ctx->latency = MAX_LATENCY;
+			if (ctx->latency > (int) (ctx->buffer_frames * ctx->frame_size) - BUFFER_HEADROOM) {
+				ctx->latency = max((int) (ctx->buffer_frames * ctx->frame_size) - BUFFER_HEADROOM, MIN_LATENCY);
+			}
+			ctx->synchro.rtp = (ctx->synchro.status & RTP_SYNC) ? RTP_UNWRAP(ctx->synchro.rtp, rtp_now - ctx->latency) :
+																   rtp_now - ctx->latency;
+			ctx->synchro.time = playtime;
 
-				/*
-				  The expected elapsed remote time should be exactly the same as
-				  elapsed local time between the two request, corrected by the
-				  drifting
-				u64_t expected = ctx->timing.remote + MS2NTP(reference - ctx->timing.local);
-				*/
+			// now we are synced on RTP frames
+			ctx->synchro.status |= RTP_SYNC;
 
-				ctx->timing.remote = remote;
-				ctx->timing.local = reference;
+			// 1st sync packet received (signals a restart of playback)
+			if (packet[0] & 0x10) {
+				LOG_INFO("[%p]: 1st sync packet received", ctx);
+			}
 
-				// now we are synced on NTP (mutex not needed)
-				ctx->synchro.status |= NTP_SYNC;
+			pthread_mutex_unlock(&ctx->ab_mutex);
 
-				LOG_DEBUG("[%p]: Timing references local:%llu, remote:%llx (delta:%lld, sum:%lld, adjust:%lld, gaps:%d)",
-						  ctx, ctx->timing.local, ctx->timing.remote);
+			LOG_DEBUG("[%p]: sync packet latency:%d rtp_latency:%u rtp:%u remote ntp:%llx, local time:%llu local rtp:%llu (now:%llu)",
+					  ctx, ctx->latency, rtp_now_latency, rtp_now, remote, ctx->synchro.time, ctx->synchro.rtp, rtp_time(ctx));
 
-				break;
-			}
+			if ((ctx->synchro.status & RTP_SYNC) && (ctx->synchro.status & NTP_SYNC)) ctx->cmd_cb(RAOP_TIMING, clock_sync_ppm(&ctx->clock));
+
+			break;
+		}
 
-			default: {
-				LOG_WARN("Unknown packet received %x", (int) type);
+		// NTP timing packet
+		case 0x53: {
+			u32_t reference   = ntohl(*(u32_t*)(pktp+12)); // only low 32 bits in our case
+			u64_t remote 	  =(((u64_t) ntohl(*(u32_t*)(pktp+16))) << 32) + ntohl(*(u32_t*)(pktp+20));
+			u64_t now		  = rtp_time(ctx);
+			u32_t roundtrip   = (u32_t) now - reference;
+
+			// better discard sync packets when roundtrip is suspicious
+			if (roundtrip > 100000) {
+				// ask for another one only if we are not synced already
+				if (!(ctx->synchro.status & NTP_SYNC)) rtp_request_timing(ctx);
+				LOG_WARN("[%p]: discarding NTP roundtrip of %u us", ctx, roundtrip);
 				break;
 			}
-		}
-	}
 
-	free(packet);
-	LOG_INFO("[%p]: terminating", ctx);
+			/*
+			  The remote time was read somewhere during the round trip, so
+			  every reply is only good to half of it. The clock model keeps
+			  the best recent replies and fits offset and rate through them
+			  rather than jumping to the latest one.
+			*/
+			ctx->timing.remote = remote;
+			ctx->timing.local = now - roundtrip;
+			clock_sync_update(&ctx->clock, now - roundtrip, now, remote);
+			nack_update_rtt(ctx, roundtrip / 1000);
 
-#ifndef WIN32
-	xTaskNotifyGive(ctx->joiner);
-	vTaskSuspend(NULL);
-#else
-	return NULL;
-#endif
+			// now we are synced on NTP (mutex not needed)
+			ctx->synchro.status |= NTP_SYNC;
+
+			LOG_DEBUG("[%p]: Timing references local:%llu, remote:%llx (rtt:%u us, best:%u us, skew:%d ppm)",
+					  ctx, ctx->timing.local, ctx->timing.remote, roundtrip, ctx->clock.min_rtt, clock_sync_ppm(&ctx->clock));
+
+			break;
+		}
+
+		default: {
+			LOG_WARN("Unknown packet received %x", (int) type);
+			break;
+		}
+	}
 }
 
 /*---------------------------------------------------------------------------*/
 static bool rtp_request_timing(rtp_t *ctx) {
 	unsigned char req[32];
-	u32_t now = gettime_ms();
+	u32_t now = (u32_t) rtp_time(ctx);
 	int i;
 	struct sockaddr_in host;
 
+#ifdef __RTP_STORE
+	// the capture has the replies already
+	if (ctx->replay) return true;
+#endif
+
 	LOG_DEBUG("[%p]: timing request now:%u (port: %hu)", ctx, now, ctx->rtp_sockets[TIMING].rport);
 
 	req[0] = 0x80;
@@ -815,7 +1722,7 @@ static bool rtp_request_timing(rtp_t *ctx) {
 	*(u32_t*)(req+4) = htonl(0);  // dummy
 	for (i = 0; i < 16; i++) req[i+8] = 0;
 	*(u32_t*)(req+24) = 0;
-	*(u32_t*)(req+28) = htonl(now); // this is not a real NTP, but a 32 ms counter in the low part of the NTP
+	*(u32_t*)(req+28) = htonl(now); // this is not a real NTP, but a 32 bits µs counter in the low part of the NTP
 
 	if (ctx->host.s_addr != INADDR_ANY) {
 		host.sin_family = AF_INET;
@@ -839,9 +1746,16 @@ static bool rtp_request_resend(rtp_t *ctx, seq_t first, seq_t last) {
 	unsigned char req[8];    // *not* a standard RTCP NACK
 
 	// do not request silly ranges (happens in case of network large blackouts)
-	if (seq_order(last, first) || last - first > buffer_frames / 2) return false;
+	if (seq_order(last, first) || last - first > ctx->buffer_frames / 2) return false;
+
+	ctx->nack.requests++;
 
-	ctx->resent_req += (seq_t) (last - first) + 1;
+#ifdef __RTP_STORE
+	if (ctx->replay) {
+		if (ctx->channel) ctx->channel->resend(ctx->channel->arg, rtp_time(ctx), first, last);
+		return true;
+	}
+#endif
 
 	LOG_DEBUG("resend request [W:%hu R:%hu first=%hu last=%hu]", ctx->ab_write, ctx->ab_read, first, last);
 
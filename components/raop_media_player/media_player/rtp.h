@@ -12,12 +12,29 @@ typedef struct {
 rtp_resp_t 			rtp_init(struct in_addr host, int latency,
 							char *aeskey, char *aesiv, char *fmtpstr,
 							short unsigned pCtrlPort, short unsigned pTimingPort,
-							uint8_t *buffer, size_t size,
+							uint8_t *buffer, size_t size, bool lazy_decode,
 							raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb);
 void			 	rtp_end(struct rtp_s *ctx);
+size_t				rtp_buffer_size(int latency, const char *fmtpstr, bool lazy_decode);
 bool 				rtp_flush(struct rtp_s *ctx, unsigned short seqno, unsigned rtptime, bool exit_locked);
 void				rtp_flush_release(struct rtp_s *ctx);
 void 				rtp_record(struct rtp_s *ctx, unsigned short seqno, unsigned rtptime);
 void 				rtp_metadata(struct rtp_s *ctx, struct metadata_s *metadata);
+void 				rtp_get_stats(struct rtp_s *ctx, raop_stats_t *stats);
+#ifdef __RTP_STORE
+// what a replay goes through between the capture and the receive path, a
+// network model for instance: records are sent as read, delivered once due
+// (at or before until, false when none is), and resend requests answered
+typedef struct {
+	void *arg;
+	void (*send)(void *arg, uint64_t now, int source, const char *data, size_t len);
+	bool (*deliver)(void *arg, uint64_t until, uint64_t *time, int *source, char *data, size_t size, size_t *len);
+	void (*resend)(void *arg, uint64_t now, uint16_t first, uint16_t last);
+} rtp_channel_t;
+
+// feed a capture through the receive path again, through channel when set
+bool				rtp_replay(const char *path, bool realtime, const rtp_channel_t *channel,
+							   raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb);
+#endif
 
 #endif
\ No newline at end of file
@@ -425,4 +425,8 @@ void free_metadata(struct metadata_s *metadata)
 // Time utility implementation
 uint32_t gettime_ms(void) {
     return (uint32_t)(esp_timer_get_time() / 1000ULL);
+}
+
+uint64_t gettime_us(void) {
+    return (uint64_t) esp_timer_get_time();
 }
\ No newline at end of file
@@ -42,6 +42,7 @@ int shutdown_socket(int sd);
 int bind_socket(unsigned short *port, int mode);
 int conn_socket(unsigned short port);
 uint32_t gettime_ms(void);
+uint64_t gettime_us(void);
 
 // String utilities
 char *strlwr(char *str);
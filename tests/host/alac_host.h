@@ -0,0 +1,12 @@
+#pragma once
+
+// Knobs and counters of the stand-in ALAC decoder (stub/alac.cpp)
+
+#include <atomic>
+#include <stdint.h>
+
+// Time each alac_to_pcm() call takes, in us
+extern std::atomic<uint32_t> alac_host_cost_us;
+// alac_to_pcm() calls entered, and returned
+extern std::atomic<uint32_t> alac_host_started;
+extern std::atomic<uint32_t> alac_host_decodes;
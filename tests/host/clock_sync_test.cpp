@@ -0,0 +1,109 @@
+// Sender clock recovery on the host: timing exchanges every 3 s over a path
+// with jittered, asymmetric delays, against a sender clock off by a few tens
+// of ppm, as the RTP thread feeds them from 0x53 replies
+
+extern "C" {
+#include "clock_sync.h"
+}
+#include "host_test.h"
+#include <math.h>
+
+#define EXCHANGE_US 3000000
+
+// xorshift32, the same draws on every run
+static uint32_t rng = 1;
+
+static uint32_t draw(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// One way delay: a floor, exponential queueing and now and then a Wi-Fi
+// retry burst
+static int64_t path_delay(int64_t floor_us) {
+    double u = (draw() >> 8) / 16777216.0;
+    int64_t delay = floor_us + (int64_t)(-1500 * log(1 - u));
+    if (draw() % 10 == 0) delay += 5000 + draw() % 30000;
+    return delay;
+}
+
+struct sender {
+    int64_t base;   // its clock at local time 0, us
+    double ppm;     // its rate against ours
+};
+
+static int64_t sender_us(const sender *s, int64_t local) {
+    return s->base + local + (int64_t)llround(local * s->ppm / 1e6);
+}
+
+static uint64_t to_ntp(int64_t us) {
+    return ((uint64_t)(us / 1000000) << 32) | (((uint64_t)(us % 1000000) << 32) / 1000000);
+}
+
+// One request/reply exchange sent at local time t
+static void exchange(clock_sync_t *clock, const sender *s, int64_t t) {
+    int64_t out = path_delay(1000), back = path_delay(1500);
+    clock_sync_update(clock, t, t + out + back, to_ntp(sender_us(s, t + out)));
+}
+
+// Where the sender reading of local time t is mapped back to, by the model
+// and by the latest reply alone, which is what playtimes used to follow
+static void run(double ppm, int minutes) {
+    sender s = { 1000000000000LL, ppm };
+    clock_sync_t clock;
+    double worst_ppm = 0;
+    int64_t worst = 0, naive_worst = 0;
+    int64_t t = 0;
+
+    clock_sync_init(&clock);
+    for (; t < (int64_t)minutes * 60000000; t += EXCHANGE_US) {
+        int64_t out = path_delay(1000), back = path_delay(1500);
+        uint64_t remote = to_ntp(sender_us(&s, t + out));
+        clock_sync_update(&clock, t, t + out + back, remote);
+
+        // the rate is only as good as the span of replies behind it
+        if (t < CLOCK_SAMPLES * EXCHANGE_US) continue;
+        // the reply taken as read when the request left
+        int64_t naive = sender_us(&s, t) - ntp_to_us(remote);
+        int64_t error = clock_sync_to_local(&clock, to_ntp(sender_us(&s, t))) - t;
+        worst = std::max(worst, std::abs(error));
+        naive_worst = std::max(naive_worst, std::abs(naive));
+        worst_ppm = std::max(worst_ppm, fabs(clock_sync_ppm(&clock) - ppm));
+    }
+
+    printf("%+.0f ppm sender, %d min: %+d ppm estimated (off by %.0f at worst), offset off by %lld us at worst, "
+           "%lld us from the latest reply alone\n",
+           ppm, minutes, clock_sync_ppm(&clock), worst_ppm, (long long)worst, (long long)naive_worst);
+    CHECK(clock.valid, "no model");
+    CHECK(worst_ppm <= 8, "ppm off by %.0f", worst_ppm);
+    CHECK(worst <= 1000, "offset off by %lld us", (long long)worst);
+}
+
+// The sender restarts its clock: the history is dropped and the model
+// follows the new clock from the next replies on
+static void test_step(void) {
+    sender s = { 5000000000LL, 80 };
+    clock_sync_t clock;
+    int64_t t = 0;
+
+    clock_sync_init(&clock);
+    for (; t < 120000000; t += EXCHANGE_US) exchange(&clock, &s, t);
+
+    s.base -= 3600000000LL;
+    for (int i = 0; i < 3; i++, t += EXCHANGE_US) exchange(&clock, &s, t);
+
+    int64_t error = clock_sync_to_local(&clock, to_ntp(sender_us(&s, t))) - t;
+    printf("sender clock stepped back 1 h: offset off by %lld us 3 replies later\n", (long long)error);
+    CHECK(clock.valid, "no model");
+    CHECK(std::abs(error) <= 20000, "offset off by %lld us", (long long)error);
+}
+
+int main(void) {
+    run(80, 10);
+    run(-80, 10);
+    run(0, 10);
+    test_step();
+    return TEST_END();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Forced into the component's C sources (rtp.cpp and what it links with):
+// what the ESP-IDF build gives them without an include of their own
+
+#define CONFIG_PTHREAD_TASK_CORE_DEFAULT -1
+#define CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT 5
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#include "esp_heap_caps.h"
+#include "freertos/task.h"
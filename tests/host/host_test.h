@@ -0,0 +1,39 @@
+#pragma once
+
+// Minimal checks for the host tests: a failed CHECK reports and counts, the
+// test binary exits with the number of failures
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+static int host_failures;
+
+#define CHECK(cond, format, ...) \
+    do { \
+        if (!(cond)) { \
+            host_failures++; \
+            fprintf(stderr, "FAIL %s:%d: %s: " format "\n", __FILE__, __LINE__, #cond, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define TEST_END() (printf("%s\n", host_failures ? "FAILED" : "OK"), host_failures)
+
+// Percentiles of a sample set, in its own unit
+struct host_percentiles {
+    double mean, p50, p99, max;
+};
+
+static inline host_percentiles percentiles(std::vector<int64_t> values) {
+    host_percentiles p = { 0, 0, 0, 0 };
+    if (values.empty()) return p;
+    std::sort(values.begin(), values.end());
+    for (int64_t v : values) p.mean += v;
+    p.mean /= values.size();
+    p.p50 = values[values.size() / 2];
+    p.p99 = values[values.size() * 99 / 100];
+    p.max = values.back();
+    return p;
+}
@@ -0,0 +1,216 @@
+/*
+ * Lossy network model for RTP replays
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#define __RTP_STORE
+#include "impair.h"
+
+#define IMPAIR_DATA		0		// socket of audio packets, as in the capture
+#define IMPAIR_CONTROL	1		// socket resends come back on
+
+/*---------------------------------------------------------------------------*/
+bool impair_init(impair_t *impair, const impair_cfg_t *cfg) {
+	memset(impair, 0, sizeof(impair_t));
+	impair->cfg = *cfg;
+	impair->rng = cfg->seed ? cfg->seed : 1;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void impair_free(impair_t *impair) {
+	for (int i = 0; i < IMPAIR_POOL; i++) free(impair->pool[i]);
+	for (int i = 0; i < impair->count; i++) free(impair->queue[i]);
+	memset(impair->pool, 0, sizeof(impair->pool));
+	impair->count = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// xorshift32, all that is needed and the same everywhere
+static uint32_t impair_random(impair_t *impair) {
+	uint32_t x = impair->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return impair->rng = x;
+}
+
+static bool impair_chance(impair_t *impair, float p) {
+	return p > 0 && (impair_random(impair) >> 8) < (uint32_t) (p * (1 << 24));
+}
+
+/*---------------------------------------------------------------------------*/
+static impair_packet_t *impair_copy(uint64_t time, int source, const char *head, size_t head_len, const char *data, size_t len) {
+	impair_packet_t *packet = (impair_packet_t*) malloc(sizeof(impair_packet_t) + head_len + len);
+
+	if (!packet) return NULL;
+	packet->time = time;
+	packet->source = source;
+	packet->len = head_len + len;
+	if (head_len) memcpy(packet->data, head, head_len);
+	memcpy(packet->data + head_len, data, len);
+	return packet;
+}
+
+/*---------------------------------------------------------------------------*/
+// insert after anything due at the same time, so that untouched traffic
+// keeps its order
+static void impair_enqueue(impair_t *impair, impair_packet_t *packet) {
+	int i;
+
+	if (!packet) return;
+	if (impair->count == IMPAIR_QUEUE) {
+		impair->stats.overflow++;
+		free(packet);
+		return;
+	}
+
+	for (i = impair->count; i > 0 && impair->queue[i - 1]->time > packet->time; i--) impair->queue[i] = impair->queue[i - 1];
+	impair->queue[i] = packet;
+	impair->count++;
+}
+
+/*---------------------------------------------------------------------------*/
+static void impair_send(impair_t *impair, uint64_t now, int source, const char *head, size_t head_len, const char *data, size_t len) {
+	uint32_t delay = 0;
+
+	// Gilbert-Elliott: a good and a bad state, each with its own loss
+	if (impair->bad) {
+		if (impair_chance(impair, impair->cfg.burst_exit)) impair->bad = false;
+	} else if (impair_chance(impair, impair->cfg.burst_enter)) {
+		impair->bad = true;
+		impair->stats.bursts++;
+	}
+
+	if (impair_chance(impair, impair->bad ? impair->cfg.burst_loss : impair->cfg.loss)) {
+		impair->stats.lost++;
+		return;
+	}
+
+	if (impair->cfg.jitter_us) delay = impair_random(impair) % (impair->cfg.jitter_us + 1);
+	if (impair_chance(impair, impair->cfg.reorder)) {
+		delay += impair->cfg.reorder_us;
+		impair->stats.reordered++;
+	}
+
+	impair->stats.delay_sum += delay;
+	if (delay > impair->stats.delay_max) impair->stats.delay_max = delay;
+
+	impair_enqueue(impair, impair_copy(now + delay, source, head, head_len, data, len));
+	if (impair_chance(impair, impair->cfg.duplicate)) {
+		impair_enqueue(impair, impair_copy(now + delay, source, head, head_len, data, len));
+		impair->stats.duplicated++;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void impair_push(impair_t *impair, uint64_t now, int source, const char *data, size_t len) {
+	if (source != IMPAIR_DATA || len < 4) {
+		impair_enqueue(impair, impair_copy(now, source, NULL, 0, data, len));
+		return;
+	}
+
+	// what the sender keeps to answer resends
+	uint16_t seqno = ((uint8_t) data[2] << 8) | (uint8_t) data[3];
+	impair_packet_t **slot = impair->pool + (seqno % IMPAIR_POOL);
+	free(*slot);
+	*slot = impair_copy(now, source, NULL, 0, data, len);
+
+	impair->stats.packets++;
+	impair_send(impair, now, source, NULL, 0, data, len);
+}
+
+/*---------------------------------------------------------------------------*/
+void impair_resend(impair_t *impair, uint64_t now, uint16_t first, uint16_t last) {
+	if (!impair->cfg.resend_us) return;
+
+	for (uint16_t seqno = first; ; seqno++) {
+		impair_packet_t *packet = impair->pool[seqno % IMPAIR_POOL];
+
+		if (packet && (((uint8_t) packet->data[2] << 8) | (uint8_t) packet->data[3]) == seqno) {
+			// Apple resend, the original packet behind a 4 bytes header
+			char head[4] = { (char) 0x80, (char) (0x56 | 0x80), (char) (seqno >> 8), (char) seqno };
+			impair_send(impair, now + impair->cfg.resend_us, IMPAIR_CONTROL, head, sizeof(head), packet->data, packet->len);
+			impair->stats.resent++;
+		} else {
+			impair->stats.resend_missed++;
+		}
+
+		if (seqno == last) break;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+bool impair_pop(impair_t *impair, uint64_t until, uint64_t *time, int *source, char *data, size_t size, size_t *len) {
+	while (impair->count && impair->queue[0]->time <= until) {
+		impair_packet_t *packet = impair->queue[0];
+		bool fits = packet->len <= size;
+
+		memmove(impair->queue, impair->queue + 1, --impair->count * sizeof(impair_packet_t*));
+
+		if (fits) {
+			*time = packet->time;
+			*source = packet->source;
+			*len = packet->len;
+			memcpy(data, packet->data, packet->len);
+		} else {
+			impair->stats.overflow++;
+		}
+
+		free(packet);
+		if (fits) return true;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void channel_send(void *arg, uint64_t now, int source, const char *data, size_t len) {
+	impair_push((impair_t*) arg, now, source, data, len);
+}
+
+static bool channel_deliver(void *arg, uint64_t until, uint64_t *time, int *source, char *data, size_t size, size_t *len) {
+	return impair_pop((impair_t*) arg, until, time, source, data, size, len);
+}
+
+static void channel_resend(void *arg, uint64_t now, uint16_t first, uint16_t last) {
+	impair_resend((impair_t*) arg, now, first, last);
+}
+
+void impair_channel(impair_t *impair, rtp_channel_t *channel) {
+	channel->arg = impair;
+	channel->send = channel_send;
+	channel->deliver = channel_deliver;
+	channel->resend = channel_resend;
+}
+
+/*---------------------------------------------------------------------------*/
+// resends take 20 ms to come back unless said otherwise; a Gilbert-Elliott
+// burst lasts 1/burst_exit packets on average
+const impair_scenario_t impair_scenarios[] = {
+	{ "clean",		{ .resend_us = 20000, .seed = 1 } },
+	{ "loss1",		{ .loss = 0.01f, .resend_us = 20000, .seed = 2 } },
+	{ "loss5",		{ .loss = 0.05f, .resend_us = 20000, .seed = 3 } },
+	{ "noresend",	{ .loss = 0.02f, .seed = 4 } },
+	{ "burst",		{ .loss = 0.002f, .burst_enter = 0.005f, .burst_exit = 0.2f, .burst_loss = 0.8f,
+					  .resend_us = 20000, .seed = 5 } },
+	{ "jitter",		{ .jitter_us = 40000, .resend_us = 20000, .seed = 6 } },
+	{ "reorder",	{ .reorder = 0.02f, .reorder_us = 15000, .resend_us = 20000, .seed = 7 } },
+	{ "duplicate",	{ .duplicate = 0.02f, .resend_us = 20000, .seed = 8 } },
+	{ "wifi",		{ .loss = 0.01f, .burst_enter = 0.003f, .burst_exit = 0.25f, .burst_loss = 0.6f,
+					  .jitter_us = 20000, .reorder = 0.01f, .reorder_us = 10000, .duplicate = 0.005f,
+					  .resend_us = 30000, .seed = 9 } },
+	{ NULL }
+};
+
+const impair_cfg_t *impair_find(const char *name) {
+	for (const impair_scenario_t *s = impair_scenarios; s->name; s++) {
+		if (!strcmp(s->name, name)) return &s->cfg;
+	}
+	return NULL;
+}
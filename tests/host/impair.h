@@ -0,0 +1,78 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "rtp.h"		// built with __RTP_STORE, for rtp_channel_t
+
+/*
+ * Lossy network model for RTP replays on the host (rtp_replay(), built with
+ * __RTP_STORE). Audio packets go through random and
+ * Gilbert-Elliott burst loss, uniform jitter, occasional reordering and
+ * duplication; everything else goes through untouched, in order. The sender
+ * side is modelled as well: the last IMPAIR_POOL audio packets are kept so
+ * that resend requests are answered, through the same lossy channel.
+ *
+ * Probabilities are in [0,1], times in microseconds. A given seed always
+ * makes the same decisions, so scenarios can be compared run to run.
+ */
+#define IMPAIR_POOL		512
+#define IMPAIR_QUEUE	256
+
+typedef struct {
+	float loss;				// loss in the good state
+	float burst_enter;		// per packet, good to bad
+	float burst_exit;		// per packet, bad to good
+	float burst_loss;		// loss in the bad state
+	uint32_t jitter_us;		// extra delay drawn in [0, jitter_us]
+	float reorder;			// held back another reorder_us
+	uint32_t reorder_us;
+	float duplicate;
+	uint32_t resend_us;		// round trip of a resend, 0 to ignore requests
+	uint32_t seed;
+} impair_cfg_t;
+
+typedef struct {
+	uint64_t time;
+	uint8_t source;
+	uint16_t len;
+	char data[];
+} impair_packet_t;
+
+typedef struct {
+	impair_cfg_t cfg;
+	uint32_t rng;
+	bool bad;
+	impair_packet_t *pool[IMPAIR_POOL];		// by seqno, as sent
+	impair_packet_t *queue[IMPAIR_QUEUE];	// in flight, by delivery time
+	int count;
+	struct {
+		uint32_t packets, lost, bursts, reordered, duplicated, overflow;
+		uint32_t resent, resend_missed;		// answered, or gone from the pool
+		uint64_t delay_sum;
+		uint32_t delay_max;
+	} stats;
+} impair_t;
+
+bool	impair_init(impair_t *impair, const impair_cfg_t *cfg);
+void	impair_free(impair_t *impair);
+// send one record, data sources (0) are impaired, others pass through
+void	impair_push(impair_t *impair, uint64_t now, int source, const char *data, size_t len);
+// answer a resend request for first..last, as the sender would
+void	impair_resend(impair_t *impair, uint64_t now, uint16_t first, uint16_t last);
+// next packet delivered at or before until, copied to data (size bytes at most)
+bool	impair_pop(impair_t *impair, uint64_t until, uint64_t *time, int *source, char *data, size_t size, size_t *len);
+// the model as the channel rtp_replay() sends through
+void	impair_channel(impair_t *impair, rtp_channel_t *channel);
+
+// named network conditions, ending with a NULL name
+typedef struct {
+	const char *name;
+	impair_cfg_t cfg;
+} impair_scenario_t;
+
+extern const impair_scenario_t impair_scenarios[];
+const impair_cfg_t *impair_find(const char *name);
+
+#endif
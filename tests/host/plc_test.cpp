@@ -0,0 +1,152 @@
+// Loss concealment on the host: the period found and the waveform carried
+// on wherever the history ring has wrapped, and over a minute of a harmonic
+// signal with 1 to 5% of its frames lost, how much closer to the original it
+// stays than silence would. With --bench, the same at each loss rate with
+// the time taken per frame played and per frame concealed
+
+extern "C" {
+#include "plc.h"
+}
+#include "host_test.h"
+#include <chrono>
+#include <math.h>
+#include <string.h>
+
+#define RATE 44100
+#define FRAME 352
+
+static int64_t now_ns(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A 196 Hz note with four harmonics and a slow vibrato, a little apart
+// between channels, over some noise
+static void note(int16_t *out, size_t first, size_t samples, uint32_t *noise) {
+    for (size_t i = 0; i < samples; i++) {
+        double t = (double)(first + i) / RATE;
+        double phase = 2 * M_PI * 196 * t + 0.6 * sin(2 * M_PI * 5 * t);
+        double v = 0;
+        for (int h = 1; h <= 4; h++) v += sin(h * phase) / h;
+        for (int c = 0; c < 2; c++) {
+            *noise ^= *noise << 13, *noise ^= *noise >> 17, *noise ^= *noise << 5;
+            out[2 * i + c] = (int16_t)lrint(9000 * v * (c ? 0.9 : 1) + (int)(*noise % 200) - 100);
+        }
+    }
+}
+
+// A 441 Hz tone is 100 samples a period, whatever the frame sizes that
+// brought it in
+static void test_wrap(int frame) {
+    int16_t *pcm = (int16_t *)malloc(frame * 2 * sizeof(int16_t)), expected[FRAME * 2];
+    size_t position = 0;
+    plc_t plc;
+    int worst = 0;
+
+    plc_init(&plc, FRAME);
+    for (int f = 0; f < 7; f++, position += frame) {
+        for (int i = 0; i < frame; i++) {
+            pcm[2 * i] = pcm[2 * i + 1] = (int16_t)lrint(12000 * sin(2 * M_PI * (position + i) / 100));
+        }
+        plc_received(&plc, pcm, frame);
+    }
+
+    const int16_t *concealed = plc_conceal(&plc);
+    for (int i = 0; i < FRAME; i++) {
+        expected[2 * i] = (int16_t)lrint(12000 * sin(2 * M_PI * (position + i) / 100));
+        worst = std::max(worst, abs(concealed[2 * i] - expected[2 * i]));
+    }
+
+    printf("%d samples frames, history at %d: period %d, concealed frame off by %d at worst\n", frame, plc.head,
+           plc.period, worst);
+    CHECK(plc.period == 100, "period %d", plc.period);
+    CHECK(worst <= 200, "off by %d", worst);
+    plc_free(&plc);
+    free(pcm);
+}
+
+struct loss_result {
+    double snr, lost_snr, silence_snr;
+    double received_us, concealed_us;
+    uint32_t lost;
+};
+
+// A minute played with loss_permille of the frames missing, concealed, and
+// compared with the original as a whole and over the missing frames; silence
+// in their place gives 0 dB on those
+static loss_result run_loss(uint32_t loss_permille) {
+    const uint32_t frames = 60 * RATE / FRAME;
+    int16_t original[FRAME * 2], played[FRAME * 2];
+    double signal = 0, noise = 0, lost_signal = 0, lost_noise = 0;
+    int64_t received_ns = 0, concealed_ns = 0;
+    uint32_t random = 7, noise_seed = 1;
+    loss_result result = {};
+    plc_t plc;
+
+    plc_init(&plc, FRAME);
+    for (uint32_t f = 0; f < frames; f++) {
+        note(original, (size_t)f * FRAME, FRAME, &noise_seed);
+        random ^= random << 13, random ^= random >> 17, random ^= random << 5;
+        bool lost = f > 10 && random % 1000 < loss_permille;
+
+        int64_t start = now_ns();
+        if (lost) {
+            memcpy(played, plc_conceal(&plc), sizeof(played));
+            concealed_ns += now_ns() - start;
+            result.lost++;
+        } else {
+            memcpy(played, original, sizeof(played));
+            plc_received(&plc, played, FRAME);
+            received_ns += now_ns() - start;
+        }
+
+        for (int i = 0; i < FRAME * 2; i++) {
+            double e = played[i] - original[i];
+            signal += (double)original[i] * original[i];
+            noise += e * e;
+            if (lost) {
+                lost_signal += (double)original[i] * original[i];
+                lost_noise += e * e;
+            }
+        }
+    }
+
+    result.snr = 10 * log10(signal / noise);
+    result.lost_snr = 10 * log10(lost_signal / lost_noise);
+    result.silence_snr = 10 * log10(signal / lost_signal);
+    result.received_us = received_ns / 1000.0 / (frames - result.lost);
+    result.concealed_us = concealed_ns / 1000.0 / result.lost;
+    plc_free(&plc);
+    return result;
+}
+
+static void print_loss(uint32_t loss_permille, const loss_result &r) {
+    printf("%.1f%% loss, %u frames: SNR %.1f dB (silence %.1f dB), %.1f dB over lost frames; "
+           "%.2f us/frame played, %.2f us/frame concealed\n",
+           loss_permille / 10.0, r.lost, r.snr, r.silence_snr, r.lost_snr, r.received_us, r.concealed_us);
+}
+
+static void test_loss(uint32_t loss_permille) {
+    loss_result r = run_loss(loss_permille);
+
+    print_loss(loss_permille, r);
+    CHECK(r.lost > 0, "nothing lost");
+    CHECK(r.lost_snr >= 6, "%.1f dB over lost frames", r.lost_snr);
+    CHECK(r.snr >= r.silence_snr + 6, "%.1f dB, silence gives %.1f dB", r.snr, r.silence_snr);
+}
+
+int main(int argc, char **argv) {
+    bool bench = argc > 1 && !strcmp(argv[1], "--bench");
+
+    if (bench) {
+        for (uint32_t loss = 10; loss <= 50; loss += 10) print_loss(loss, run_loss(loss));
+        return TEST_END();
+    }
+
+    test_wrap(FRAME);
+    test_wrap(300);
+    test_wrap(1100);
+    test_loss(10);
+    test_loss(50);
+    return TEST_END();
+}
@@ -0,0 +1,102 @@
+// Resampler on the host: engaging it on a running stream, and the ratio and
+// accuracy at the +/-100 ppm a sender clock is typically off by
+
+#include "resampler.h"
+#include "host_test.h"
+#include <math.h>
+#include <string.h>
+
+#define RATE 44100
+#define FRAME 352
+
+static int16_t tone(double position) {
+    return (int16_t)lrint(16000 * sin(2 * M_PI * 997 * position / RATE));
+}
+
+static void fill(int16_t *out, size_t first, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        out[2 * i] = tone(first + i);
+        out[2 * i + 1] = -out[2 * i];
+    }
+}
+
+// A stream played as is, then through the resampler from a frame boundary
+// on, as the output stage does when drift correction starts: the first
+// resampled samples continue the waveform, whatever the history held
+static void test_engage(int32_t ppm) {
+    int16_t in[FRAME * 2], out[RESAMPLER_MAX_OUTPUT(FRAME) * 2];
+    resampler_t rs;
+
+    fill(in, 0, FRAME);
+    int16_t last[2] = { in[2 * FRAME - 2], in[2 * FRAME - 1] };
+
+    // Anything left in there from another stream must not matter
+    memset(&rs, 0x5a, sizeof(rs));
+    resampler_init(&rs, last);
+    resampler_set_ppm(&rs, ppm);
+    // what the first interpolations see before the stream's own samples
+    for (int i = 0; i < 4; i++) {
+        CHECK(rs.history[i][0] == last[0] && rs.history[i][1] == last[1], "history[%d] not seeded", i);
+    }
+
+    int worst = 0, natural = 0;
+    size_t position = FRAME, produced = 0;
+    for (int f = 1; f < 4; f++, position += FRAME) {
+        fill(in, position, FRAME);
+        size_t n = resampler_process(&rs, in, FRAME, out);
+        for (size_t i = 0; i < n; i++, produced++) {
+            // Where output sample produced sits on the input timeline
+            double at = FRAME + produced * (1 + ppm / 1e6);
+            int error = abs(out[2 * i] - (int)lrint(16000 * sin(2 * M_PI * 997 * at / RATE)));
+            worst = error > worst ? error : worst;
+        }
+        if (f == 1) natural = abs(out[0] - last[0]);
+    }
+
+    printf("engaged at %+d ppm: first step %d, worst error %d\n", (int)ppm, natural, worst);
+    CHECK(worst <= 64, "%d off the waveform at %+d ppm", worst, (int)ppm);
+    // one sample of a 997 Hz full scale tone moves by 2270 at most
+    CHECK(natural <= 2300, "first step %d", natural);
+}
+
+// Long run at a fixed ratio: output count within a sample of the exact
+// ratio, and the signal to noise ratio of the interpolation
+static void test_ratio(int32_t ppm) {
+    const size_t frames = 60 * RATE / FRAME;
+    int16_t in[FRAME * 2], out[RESAMPLER_MAX_OUTPUT(FRAME) * 2];
+    resampler_t rs;
+    double signal = 0, noise = 0;
+    size_t produced = 0;
+
+    resampler_init(&rs, NULL);
+    resampler_set_ppm(&rs, ppm);
+
+    for (size_t f = 0; f < frames; f++) {
+        fill(in, f * FRAME, FRAME);
+        size_t n = resampler_process(&rs, in, FRAME, out);
+        CHECK(n <= RESAMPLER_MAX_OUTPUT(FRAME), "%zu frames out", n);
+        for (size_t i = 0; i < n; i++, produced++) {
+            if (produced < 4) continue;
+            double ideal = 16000 * sin(2 * M_PI * 997 * (produced * (double)rs.step / 4294967296.0) / RATE);
+            signal += ideal * ideal;
+            noise += (out[2 * i] - ideal) * (out[2 * i] - ideal);
+        }
+    }
+
+    // two samples stay in the history
+    double expected = (frames * FRAME - 2) / (1 + ppm / 1e6);
+    double snr = 10 * log10(signal / noise);
+    printf("%+d ppm over 60 s: %zu samples out, %.1f expected, SNR %.1f dB\n", (int)ppm, produced, expected, snr);
+    CHECK(fabs(produced - expected) <= 1.5, "%zu samples out, %.1f expected", produced, expected);
+    CHECK(snr >= 60, "SNR %.1f dB", snr);
+}
+
+int main(void) {
+    test_engage(100);
+    test_engage(-100);
+    test_engage(RESAMPLER_MAX_PPM);
+    test_engage(-RESAMPLER_MAX_PPM);
+    test_ratio(100);
+    test_ratio(-100);
+    return TEST_END();
+}
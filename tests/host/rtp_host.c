@@ -0,0 +1,126 @@
+// rtp.cpp built as the C it is, with the entry points of rtp_host.h and the
+// few util.cpp and raop.cpp symbols it uses
+
+#include "rtp.cpp"
+#include "rtp_host.h"
+
+log_level raop_loglevel = lINFO;
+int64_t rtp_host_now;
+
+uint64_t gettime_us(void) {
+	return rtp_host_now ? rtp_host_now : esp_timer_get_time();
+}
+
+uint32_t gettime_ms(void) {
+	return gettime_us() / 1000;
+}
+
+// no sockets on the host, packets come through rtp_host_receive()
+int bind_socket(unsigned short *port, int mode) {
+	return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+static rtp_t *host_open(int latency, const char *fmtp, bool lazy, bool decoder, uint8_t *buffer, size_t size,
+						raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb) {
+	rtp_t *ctx = calloc(1, sizeof(rtp_t));
+	char *fmtpstr = strdup(fmtp);
+	bool rc = rtp_setup(ctx, latency, NULL, NULL, fmtpstr, buffer, size, lazy, cmd_cb, data_cb);
+
+	free(fmtpstr);
+	for (int i = 0; i < 3; i++) ctx->rtp_sockets[i].sock = -1;
+	ctx->running = true;
+	if (rc && decoder) rc = decoder_start(ctx, tskNO_AFFINITY);
+	if (!rc) {
+		rtp_host_close(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*---------------------------------------------------------------------------*/
+rtp_t *rtp_host_open(int latency, const char *fmtp, bool lazy, bool decoder, raop_cmd_cb_t cmd_cb,
+					 raop_data_cb_t data_cb) {
+	return host_open(latency, fmtp, lazy, decoder, NULL, 0, cmd_cb, data_cb);
+}
+
+/*---------------------------------------------------------------------------*/
+rtp_t *rtp_host_open_sink(int latency, const char *fmtp, bool lazy, uint8_t *buffer, size_t size,
+						  raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb) {
+	return host_open(latency, fmtp, lazy, false, buffer, size, cmd_cb, data_cb);
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_host_close(rtp_t *ctx) {
+	// what rtp_end() does for the decoder, there is no RTP thread to wait for
+	if (ctx->decoder.task) {
+		ctx->joiner = xTaskGetCurrentTaskHandle();
+		ctx->running = false;
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+	}
+	ctx->running = false;
+	rtp_end(ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_host_receive(rtp_t *ctx, int source, char *packet, size_t len) {
+	rtp_process(ctx, source, packet, len);
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_host_settle(rtp_t *ctx) {
+	if (!ctx->decoder.task) return;
+	// slots go back to the free queue once placed
+	while (uxQueueMessagesWaiting(ctx->decoder.free) < DECODE_SLOTS) vTaskDelay(1);
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t rtp_host_ready(rtp_t *ctx) {
+	uint32_t count = 0;
+
+	pthread_mutex_lock(&ctx->ab_mutex);
+	for (u32_t i = 0; i < ctx->buffer_frames / 32; i++) count += __builtin_popcount(ctx->ab_ready[i]);
+	pthread_mutex_unlock(&ctx->ab_mutex);
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t rtp_host_slots(rtp_t *ctx, uint32_t *from_sink) {
+	*from_sink = 0;
+	for (u32_t i = 0; i < ctx->buffer_frames; i++) *from_sink += !ctx->audio_buffer[i].allocated;
+	return ctx->buffer_frames;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t rtp_host_chunks(rtp_t *ctx, bool *from_sink) {
+	*from_sink = ctx->chunks.pool && !ctx->chunks.allocated;
+	return ctx->chunks.count;
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_host_decoder(rtp_t *ctx, uint32_t *peak, uint32_t *dropped) {
+	*peak = ctx->decoder.peak;
+	*dropped = ctx->decoder.dropped;
+}
+
+/*---------------------------------------------------------------------------*/
+void rtp_host_nack(rtp_t *ctx, uint32_t *scans, uint64_t *scan_ns, uint32_t *requests) {
+	*scans = ctx->nack.scans;
+	*scan_ns = ctx->nack.scan_cycles;
+	*requests = ctx->nack.requests;
+}
+
+#ifdef __RTP_STORE
+/*---------------------------------------------------------------------------*/
+bool rtp_host_capture(rtp_t *ctx, const char *path, int latency, const char *fmtp, bool lazy) {
+	char *fmtpstr = strdup(fmtp);
+
+	ctx->capture = capture_open(path, latency, NULL, NULL, fmtpstr, lazy);
+	if (ctx->capture) pthread_mutex_init(&ctx->capture_mutex, 0);
+	free(fmtpstr);
+
+	return ctx->capture != NULL;
+}
+#endif
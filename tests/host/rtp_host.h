@@ -0,0 +1,52 @@
+#pragma once
+
+// rtp.cpp is C and keeps its receive path to itself: rtp_host.c builds it
+// with these entry points, so that tests feed it packets without sockets
+// nor RTP thread, the caller standing in for the latter
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "rtp.h"
+
+// The time the receive path sees, in us, the real one while 0
+extern int64_t rtp_host_now;
+
+// A stream as RAOP_SETUP opens it, in clear; with decoder, packets are
+// decoded by the decode task, else on the caller's thread
+struct rtp_s *rtp_host_open(int latency, const char *fmtp, bool lazy, bool decoder, raop_cmd_cb_t cmd_cb,
+                            raop_data_cb_t data_cb);
+// The same with the buffer a sink gives at RAOP_SETUP, decoding on the
+// caller's thread
+struct rtp_s *rtp_host_open_sink(int latency, const char *fmtp, bool lazy, uint8_t *buffer, size_t size,
+                                 raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb);
+void rtp_host_close(struct rtp_s *ctx);
+// One packet from a socket (0 data, 1 control, 2 timing), as the RTP thread
+// gets it
+void rtp_host_receive(struct rtp_s *ctx, int source, char *packet, size_t len);
+// Returns once the decode task has placed everything queued to it
+void rtp_host_settle(struct rtp_s *ctx);
+// Frames ready in the jitter buffer
+uint32_t rtp_host_ready(struct rtp_s *ctx);
+// Jitter buffer slots, and how many of them are in the sink's buffer
+uint32_t rtp_host_slots(struct rtp_s *ctx, uint32_t *from_sink);
+// Lazy decode chunks, and whether the pool is the sink's buffer
+uint32_t rtp_host_chunks(struct rtp_s *ctx, bool *from_sink);
+// Decode queue high water mark and packets dropped because it was full
+void rtp_host_decoder(struct rtp_s *ctx, uint32_t *peak, uint32_t *dropped);
+// Resend scans so far, the time they took (esp_cpu cycles, ns on the host)
+// and the requests they sent
+void rtp_host_nack(struct rtp_s *ctx, uint32_t *scans, uint64_t *scan_ns, uint32_t *requests);
+#ifdef __RTP_STORE
+// Captures what the stream receives from now on to path, as rtp_init() does
+// to RTP_CAPTURE, for rtp_replay()
+bool rtp_host_capture(struct rtp_s *ctx, const char *path, int latency, const char *fmtp, bool lazy);
+#endif
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+// Runs a capture made by a build with __RTP_STORE (on the device, or with
+// --write here) through the receive path again, through one of the network
+// models of impair.c with --impair, and prints what came out of it
+//
+//   rtp_replay [--realtime] [--impair <scenario>] <capture>
+//   rtp_replay --write <capture> [seconds]    a clean synthetic stream
+
+#define __RTP_STORE
+#include "rtp_sender.h"
+extern "C" {
+#include "impair.h"
+}
+#include <stdarg.h>
+#include <stdio.h>
+
+static uint32_t calls, frames;
+static raop_stats_t stats;
+static bool have_stats;
+
+static bool on_cmd(raop_event_t event, ...) {
+    va_list args;
+
+    va_start(args, event);
+    if (event == RAOP_STATS) {
+        stats = *va_arg(args, const raop_stats_t *);
+        have_stats = true;
+    }
+    va_end(args);
+    return true;
+}
+
+static void on_data(const uint8_t *data, size_t len, int64_t playtime) {
+    (void)data, (void)playtime;
+    calls++;
+    frames += len / 4 / FRAME;
+}
+
+static int usage(const char *name) {
+    fprintf(stderr, "usage: %s [--realtime] [--impair <scenario>] <capture>\n       %s --write <capture> [seconds]\n",
+            name, name);
+    fprintf(stderr, "scenarios:");
+    for (const impair_scenario_t *s = impair_scenarios; s->name; s++) fprintf(stderr, " %s", s->name);
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    const impair_cfg_t *cfg = NULL;
+    bool realtime = false;
+    impair_t impair;
+    rtp_channel_t channel;
+    int i = 1;
+
+    if (argc > 2 && !strcmp(argv[1], "--write")) {
+        uint32_t seconds = argc > 3 ? atoi(argv[3]) : 10, packets = write_capture(argv[2], seconds, on_cmd, on_data);
+        if (!packets) fprintf(stderr, "cannot write %s\n", argv[2]);
+        else printf("%s: %u packets, %u s\n", argv[2], packets, seconds);
+        return !packets;
+    }
+
+    for (; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "--realtime")) realtime = true;
+        else if (!strcmp(argv[i], "--impair") && i + 1 < argc - 1 && (cfg = impair_find(argv[i + 1]))) i++;
+        else return usage(argv[0]);
+    }
+    if (i != argc - 1) return usage(argv[0]);
+
+    if (cfg) {
+        impair_init(&impair, cfg);
+        impair_channel(&impair, &channel);
+    }
+
+    if (!rtp_replay(argv[i], realtime, cfg ? &channel : NULL, on_cmd, on_data) || !have_stats) {
+        fprintf(stderr, "cannot replay %s\n", argv[i]);
+        return 1;
+    }
+
+    if (cfg) {
+        printf("channel: %u packets, %u lost in %u bursts, %u reordered, %u duplicated, %u overflow, "
+               "delay %u us avg %u us max, %u resent, %u not resendable\n",
+               impair.stats.packets, impair.stats.lost, impair.stats.bursts, impair.stats.reordered,
+               impair.stats.duplicated, impair.stats.overflow,
+               impair.stats.packets ? (uint32_t)(impair.stats.delay_sum / impair.stats.packets) : 0,
+               impair.stats.delay_max, impair.stats.resent, impair.stats.resend_missed);
+        impair_free(&impair);
+    }
+
+    printf("%s: %u frames played in %u writes, %u silent, %u discarded, %u/%u recovered, %u expired, "
+           "jitter %u us, arrival to playtime %.1f ms mean, %.1f ms least\n",
+           argv[i], frames, calls, stats.silent_frames, stats.discarded, stats.frames_recovered,
+           stats.frames_requested, stats.frames_expired, stats.jitter_us, stats.playout_us / 1000.0,
+           stats.playout_min_us / 1000.0);
+    return frames ? 0 : 1;
+}
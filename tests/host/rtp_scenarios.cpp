@@ -0,0 +1,152 @@
+// The receive path over impaired networks: a 30 s synthetic capture replayed
+// through each scenario of impair.c, with what reaches the sink, how much of
+// it is concealed, what is asked for again and how long frames wait from
+// arrival to their playtime, checked against what the scenario allows. With
+// --bench, only the figures
+
+#define __RTP_STORE
+#include "rtp_sender.h"
+extern "C" {
+#include "impair.h"
+}
+#include "host_test.h"
+#include <stdarg.h>
+#include <unistd.h>
+
+#define SECONDS 30
+
+static uint32_t frames;
+static raop_stats_t stats;
+
+static bool on_cmd(raop_event_t event, ...) {
+    va_list args;
+
+    va_start(args, event);
+    if (event == RAOP_STATS) stats = *va_arg(args, const raop_stats_t *);
+    va_end(args);
+    return true;
+}
+
+static void on_data(const uint8_t *data, size_t len, int64_t playtime) {
+    (void)data, (void)playtime;
+    frames += len / 4 / FRAME;
+}
+
+// What each scenario may cost: concealed frames, per mille of the stream, and
+// frames requested per packet lost (resends included), 0 where reordering
+// makes requests too and there is no bound. A frame is asked for 6 times
+// (NACK_RETRIES) at most
+struct allowance {
+    const char *name;
+    uint32_t silent_permille;
+    uint32_t requests_per_lost;
+};
+
+static const allowance allowances[] = {
+    { "clean", 0, 1 },  { "loss1", 0, 2 },   { "loss5", 1, 2 },     { "noresend", 30, 6 }, { "burst", 2, 2 },
+    { "jitter", 0, 0 }, { "reorder", 0, 0 }, { "duplicate", 0, 1 }, { "wifi", 2, 0 },
+};
+
+static void run(const char *path, uint32_t packets, const impair_scenario_t *scenario, bool bench) {
+    const uint32_t latency_us = (uint64_t)LATENCY * 1000000 / 44100;
+    const allowance *allow = NULL;
+    rtp_channel_t channel;
+    impair_t impair;
+
+    for (const allowance &a : allowances) {
+        if (!strcmp(a.name, scenario->name)) allow = &a;
+    }
+
+    frames = 0;
+    memset(&stats, 0, sizeof(stats));
+    impair_init(&impair, &scenario->cfg);
+    impair_channel(&impair, &channel);
+    bool replayed = rtp_replay(path, false, &channel, on_cmd, on_data);
+
+    printf("%-9s lost %3u (%u bursts), %3u reordered, %3u duplicated; played %u, silent %u, discarded %u, "
+           "recovered %u/%u, expired %u; arrival to playtime %.1f ms mean, %.1f ms least\n",
+           scenario->name, impair.stats.lost, impair.stats.bursts, impair.stats.reordered, impair.stats.duplicated,
+           frames, stats.silent_frames, stats.discarded, stats.frames_recovered, stats.frames_requested,
+           stats.frames_expired, stats.playout_us / 1000.0, stats.playout_min_us / 1000.0);
+
+    if (!bench) {
+        CHECK(replayed, "%s: cannot replay", scenario->name);
+        CHECK(allow, "%s: no allowance", scenario->name);
+        // every frame is played, missing ones concealed, but for what is still
+        // held behind a hole when the capture ends
+        CHECK(frames + LATENCY / FRAME >= packets, "%s: %u of %u frames played", scenario->name, frames, packets);
+        if (allow) {
+            CHECK(stats.silent_frames * 1000 <= allow->silent_permille * packets, "%s: %u frames concealed",
+                  scenario->name, stats.silent_frames);
+            CHECK(!allow->requests_per_lost || stats.frames_requested <= allow->requests_per_lost * impair.stats.lost,
+                  "%s: %u frames requested for %u lost", scenario->name, stats.frames_requested, impair.stats.lost);
+        }
+        // a frame is recovered or expires once, and only after being asked for
+        CHECK(stats.frames_recovered + stats.frames_expired <= stats.frames_requested, "%s: %u recovered, %u expired of %u",
+              scenario->name, stats.frames_recovered, stats.frames_expired, stats.frames_requested);
+        CHECK(stats.frames_expired <= stats.silent_frames, "%s: %u expired, %u concealed", scenario->name,
+              stats.frames_expired, stats.silent_frames);
+        // what is measured is the configured latency less the path delay, and
+        // a little more for the resent frames
+        uint32_t delay = impair.stats.packets ? impair.stats.delay_sum / impair.stats.packets : 0;
+        CHECK(stats.playout_us <= latency_us && stats.playout_us + delay + 10000 >= latency_us,
+              "%s: %u us from arrival to playtime, %u us path delay", scenario->name, stats.playout_us, delay);
+        CHECK(stats.playout_min_us > 0, "%s: a frame placed %d us late", scenario->name, stats.playout_min_us);
+        // unanswered, every frame concealed had been asked for
+        if (!scenario->cfg.resend_us) {
+            CHECK(stats.frames_recovered == 0, "%s: resends answered", scenario->name);
+            CHECK(stats.frames_expired == stats.silent_frames, "%s: %u expired, %u concealed", scenario->name,
+                  stats.frames_expired, stats.silent_frames);
+        }
+    }
+
+    impair_free(&impair);
+}
+
+// A capture holds the resends the sender made when it was recorded: they are
+// dropped when replaying through a channel, which answers the requests of the
+// replay instead, or each would come twice
+static uint32_t resends_sent;
+
+static void count_send(void *arg, uint64_t now, int source, const char *data, size_t len) {
+    if (source == 1 && len >= 2 && (data[1] & 0x7f) == 0x56) resends_sent++;
+    impair_push((impair_t *)arg, now, source, data, len);
+}
+
+static void test_captured_resends(const char *path) {
+    rtp_channel_t channel;
+    impair_t impair;
+    uint32_t packets = write_capture(path, 5, on_cmd, on_data, 10);
+
+    CHECK(packets, "cannot write %s", path);
+    if (!packets) return;
+
+    impair_init(&impair, impair_find("clean"));
+    impair_channel(&impair, &channel);
+    channel.send = count_send;
+    CHECK(rtp_replay(path, false, &channel, on_cmd, on_data), "cannot replay");
+    impair_free(&impair);
+
+    printf("%u packets, %u resent in the capture: %u of them sent through the channel\n", packets,
+           (packets + 9) / 10, resends_sent);
+    CHECK(resends_sent == 0, "%u captured resends replayed", resends_sent);
+}
+
+int main(int argc, char **argv) {
+    bool bench = argc > 1 && !strcmp(argv[1], "--bench");
+    char path[] = "/tmp/rtp_scenarios.XXXXXX";
+    int fd = mkstemp(path);
+    uint32_t packets;
+
+    CHECK(fd >= 0, "no temporary file");
+    if (fd < 0) return TEST_END();
+    close(fd);
+
+    packets = write_capture(path, SECONDS, on_cmd, on_data);
+    CHECK(packets, "cannot write %s", path);
+    for (const impair_scenario_t *s = impair_scenarios; packets && s->name; s++) run(path, packets, s, bench);
+    if (!bench) test_captured_resends(path);
+
+    unlink(path);
+    return TEST_END();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+// A sender as the RTP tests and tools play it, feeding packets to a host
+// stream (rtp_host.h): 352 sample frames, rtptime following seqno, the
+// sender's clock being ours
+
+#include "rtp_host.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+#define FRAME 352
+#define LATENCY 88200
+#define FMTP "96 352 0 16 40 10 14 2 255 0 0 44100"
+#define PAYLOAD 64
+#define PAYLOAD_MAX (1408 - 12)
+
+static inline void put16(char *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+}
+
+static inline void put32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+// The sender's clock is ours, in NTP format
+static inline void put_ntp(char *p, int64_t us) {
+    put32(p, us / 1000000);
+    put32(p + 4, ((us % 1000000) << 32) / 1000000);
+}
+
+// An audio packet as the sender makes it, rtptime following seqno
+static inline void send_audio(struct rtp_s *ctx, uint16_t seqno, size_t len = PAYLOAD) {
+    char packet[12 + PAYLOAD_MAX] = { (char)0x80, 0x60 };
+
+    put16(packet + 2, seqno);
+    put32(packet + 4, seqno * FRAME);
+    memset(packet + 12, seqno, len);
+    rtp_host_receive(ctx, 0, packet, 12 + len);
+}
+
+// The same, resent on the control socket as an answer to a resend request
+static inline void send_resend(struct rtp_s *ctx, uint16_t seqno, size_t len = PAYLOAD) {
+    char packet[4 + 12 + PAYLOAD_MAX] = { (char)0x80, (char)(0x56 | 0x80), 0, 0, (char)0x80, 0x60 };
+
+    put16(packet + 2, seqno);
+    put16(packet + 6, seqno);
+    put32(packet + 8, seqno * FRAME);
+    memset(packet + 16, seqno, len);
+    rtp_host_receive(ctx, 1, packet, 16 + len);
+}
+
+// A timing reply with a 1 ms round trip, then a sync packet putting rtptime
+// rtp_now at the present: frames play latency samples after their rtptime
+static inline void send_sync(struct rtp_s *ctx, uint32_t rtp_now, uint32_t latency) {
+    char timing[32] = { (char)0x80, (char)(0x53 | 0x80) }, sync[20] = { (char)0x90, (char)(0x54 | 0x80) };
+    int64_t now = gettime_us();
+
+    put32(timing + 12, now - 1000);
+    put_ntp(timing + 16, now - 500);
+    rtp_host_receive(ctx, 2, timing, sizeof(timing));
+
+    put32(sync + 4, rtp_now - latency);
+    put_ntp(sync + 8, now);
+    put32(sync + 16, rtp_now);
+    rtp_host_receive(ctx, 1, sync, sizeof(sync));
+}
+
+static inline void send_range(struct rtp_s *ctx, uint16_t first, uint16_t last, size_t len = PAYLOAD) {
+    for (uint16_t seqno = first; seqno != (uint16_t)(last + 1); seqno++) send_audio(ctx, seqno, len);
+    rtp_host_settle(ctx);
+}
+
+#ifdef __RTP_STORE
+// seconds of audio with a sync packet every second, as a sender streams them,
+// on the simulated clock and captured to path, every resend_every-th packet
+// also resent as if asked for: the packets sent, 0 when the capture cannot be
+// written
+static inline uint32_t write_capture(const char *path, uint32_t seconds, raop_cmd_cb_t cmd_cb, raop_data_cb_t data_cb,
+                                     uint32_t resend_every = 0) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, false, false, cmd_cb, data_cb);
+    uint32_t packets = seconds * 44100 / FRAME;
+
+    if (!ctx) return 0;
+    rtp_host_now = 1000000000000LL;
+    if (!rtp_host_capture(ctx, path, LATENCY, FMTP, false)) {
+        rtp_host_close(ctx);
+        rtp_host_now = 0;
+        return 0;
+    }
+
+    rtp_record(ctx, 0, 1);
+    for (uint32_t i = 0; i < packets; i++) {
+        rtp_host_now = 1000000000000LL + (int64_t)i * FRAME * 1000000 / 44100;
+        if (i % (44100 / FRAME) == 0) send_sync(ctx, i * FRAME, LATENCY);
+        send_audio(ctx, i);
+        if (resend_every && i % resend_every == 0) send_resend(ctx, i);
+    }
+
+    rtp_host_close(ctx);
+    rtp_host_now = 0;
+    return packets;
+}
+#endif
@@ -0,0 +1,4 @@
+// rtp_host.c with the capture and replay code of rtp.cpp, for rtp_replay
+
+#define __RTP_STORE
+#include "rtp_host.c"
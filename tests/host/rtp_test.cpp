@@ -0,0 +1,353 @@
+// RTP receive path on the host: packets the jitter buffer will not keep are
+// not decoded, lazy decode neither holds ab_mutex while decoding nor runs out
+// of chunks after a flush, resend scans cost nothing once the buffer is
+// drained, lead and depth histograms are relative to the latency and right
+// when drained, and what RAOP_SETUP is asked to allocate holds the slots
+// or chunks the latency takes and no more. With --bench, the per packet cost
+// at various losses, and intake of a sender's start of stream burst at 10x
+// real time with and without the decode task
+
+#include "rtp_sender.h"
+#include "alac_host.h"
+#include "esp_timer.h"
+#include "host_test.h"
+#include <unistd.h>
+
+static std::atomic<uint32_t> played;
+
+static bool on_cmd(raop_event_t event, ...) {
+    (void)event;
+    return true;
+}
+
+static void on_data(const uint8_t *data, size_t len, int64_t playtime) {
+    (void)data, (void)len, (void)playtime;
+    played++;
+}
+
+// Whatever the first seqno, a flush or the read position rule out is
+// dropped before it is decoded, and everything else still is
+static void test_wanted(bool decoder) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, false, decoder, on_cmd, on_data);
+    uint32_t decodes;
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) return;
+
+    rtp_record(ctx, 1000, 1000 * FRAME);
+    decodes = alac_host_decodes;
+    send_range(ctx, 990, 999);
+    CHECK(alac_host_decodes == decodes, "%u decoded below RECORD", alac_host_decodes - decodes);
+
+    send_range(ctx, 1000, 1010);
+    CHECK(alac_host_decodes == decodes + 11, "%u of 11 decoded", alac_host_decodes - decodes);
+    CHECK(rtp_host_ready(ctx) == 11, "%u frames ready", rtp_host_ready(ctx));
+
+    // behind the read position, which has not moved from 1000 (no sync)
+    decodes = alac_host_decodes;
+    send_range(ctx, 995, 999);
+    CHECK(alac_host_decodes == decodes, "%u decoded too late", alac_host_decodes - decodes);
+
+    // a gap, then what fills it
+    send_range(ctx, 1015, 1015);
+    send_range(ctx, 1012, 1013);
+    CHECK(alac_host_decodes == decodes + 3, "%u of 3 decoded", alac_host_decodes - decodes);
+    CHECK(rtp_host_ready(ctx) == 14, "%u frames ready", rtp_host_ready(ctx));
+
+    // a FLUSH while playing, the rest of the old stream keeps coming
+    CHECK(rtp_flush(ctx, 2000, 2000 * FRAME, false), "not flushed");
+    decodes = alac_host_decodes;
+    send_range(ctx, 1016, 1999);
+    CHECK(alac_host_decodes == decodes, "%u decoded below FLUSH", alac_host_decodes - decodes);
+    CHECK(rtp_host_ready(ctx) == 0, "%u frames ready", rtp_host_ready(ctx));
+
+    send_range(ctx, 2000, 2003);
+    CHECK(alac_host_decodes == decodes + 4, "%u of 4 decoded", alac_host_decodes - decodes);
+    CHECK(rtp_host_ready(ctx) == 4, "%u frames ready", rtp_host_ready(ctx));
+
+    rtp_host_close(ctx);
+}
+
+// Frames go to the sink as soon as they are in order once synced, so each
+// packet is decoded on arrival here. A FLUSH meanwhile takes ab_mutex at
+// once, and the frame being decoded is not played
+static void test_lazy_flush(void) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, true, true, on_cmd, on_data);
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) return;
+
+    rtp_record(ctx, 0, 1);
+    send_sync(ctx, 0, 11025);
+    played = 0;
+    send_range(ctx, 0, 9);
+    CHECK(played == 10, "%u of 10 played", played.load());
+
+    alac_host_cost_us = 20000;
+    uint32_t started = alac_host_started;
+    send_audio(ctx, 10);
+    while (alac_host_started == started) usleep(100);
+
+    int64_t now = esp_timer_get_time();
+    CHECK(rtp_flush(ctx, 100, 100 * FRAME, false), "not flushed");
+    int64_t took = esp_timer_get_time() - now;
+    rtp_host_settle(ctx);
+    alac_host_cost_us = 0;
+
+    printf("lazy decode: FLUSH took %lld us during a 20 ms decode, %u frames played\n", (long long)took,
+           played.load());
+    CHECK(took < 10000, "FLUSH waited %lld us for the decode", (long long)took);
+    CHECK(played == 10, "%u played, the flushed frame included", played.load());
+
+    rtp_host_close(ctx);
+}
+
+// Frames left behind by a flush hold their chunks until the pool runs dry
+// and they are swept back: a buffer's worth of the largest packets after
+// another one flushed still all fit
+static void test_lazy_pool(void) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, true, false, on_cmd, on_data);
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) return;
+
+    rtp_record(ctx, 1000, 1000 * FRAME);
+    send_range(ctx, 1000, 1299, PAYLOAD_MAX);
+    CHECK(rtp_host_ready(ctx) == 300, "%u of 300 frames ready", rtp_host_ready(ctx));
+
+    CHECK(rtp_flush(ctx, 2000, 2000 * FRAME, false), "not flushed");
+    send_range(ctx, 2000, 2299, PAYLOAD_MAX);
+    CHECK(rtp_host_ready(ctx) == 300, "%u of 300 frames ready after a flush", rtp_host_ready(ctx));
+
+    rtp_host_close(ctx);
+}
+
+// The sink allocates what rtp_buffer_size() says the session takes, and
+// every slot comes from it; one frame less leaves a slot allocated apart
+static void test_sink_size(int latency) {
+    size_t size = rtp_buffer_size(latency, FMTP, false);
+    uint8_t *buffer = (uint8_t *)malloc(size);
+    struct rtp_s *ctx = rtp_host_open_sink(latency, FMTP, false, buffer, size, on_cmd, on_data);
+    uint32_t slots, from_sink;
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) {
+        free(buffer);
+        return;
+    }
+
+    slots = rtp_host_slots(ctx, &from_sink);
+    printf("latency %d: %zu bytes for %u slots, %u from the sink\n", latency, size, slots, from_sink);
+    CHECK(size == (size_t)slots * FRAME * 4, "%zu bytes for %u slots", size, slots);
+    CHECK(from_sink == slots, "%u of %u slots from the sink", from_sink, slots);
+    rtp_host_close(ctx);
+
+    ctx = rtp_host_open_sink(latency, FMTP, false, buffer, size - FRAME * 4, on_cmd, on_data);
+    if (ctx) {
+        slots = rtp_host_slots(ctx, &from_sink);
+        CHECK(from_sink == slots - 1, "%u of %u slots from a short sink buffer", from_sink, slots);
+        rtp_host_close(ctx);
+    }
+    free(buffer);
+}
+
+// Lazily, it is the chunk pool that comes from the sink, all of it or none:
+// the chunks for every slot to hold 70% of a frame, and their free stack
+static void test_lazy_sink_size(int latency) {
+    size_t size = rtp_buffer_size(latency, FMTP, true), pcm_size = rtp_buffer_size(latency, FMTP, false);
+    uint8_t *buffer = (uint8_t *)malloc(size);
+    struct rtp_s *ctx = rtp_host_open_sink(latency, FMTP, true, buffer, size, on_cmd, on_data);
+    uint32_t slots, chunks, from_sink;
+    bool pool_from_sink;
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) {
+        free(buffer);
+        return;
+    }
+
+    slots = rtp_host_slots(ctx, &from_sink);
+    chunks = rtp_host_chunks(ctx, &pool_from_sink);
+    printf("lazy, latency %d: %zu bytes (%zu decoded) for %u chunks, %s\n", latency, size, pcm_size, chunks,
+           pool_from_sink ? "from the sink" : "allocated apart");
+    CHECK(pool_from_sink, "pool allocated apart");
+    CHECK(size == (size_t)chunks * (256 + 2), "%zu bytes for %u chunks", size, chunks);
+    CHECK((size_t)chunks * 256 >= (size_t)slots * (FRAME * 4 * 70 / 100), "%u chunks for %u slots", chunks, slots);
+    rtp_host_close(ctx);
+
+    ctx = rtp_host_open_sink(latency, FMTP, true, buffer, size - 1, on_cmd, on_data);
+    if (ctx) {
+        chunks = rtp_host_chunks(ctx, &pool_from_sink);
+        CHECK(!pool_from_sink, "pool in a short sink buffer");
+        rtp_host_close(ctx);
+    }
+    free(buffer);
+}
+
+// Real time on the simulated clock: a packet per frame duration, some lost,
+// with a sync first or not. The cost of each packet on the RTP thread, and of
+// the resend scans among it
+struct stream_cost {
+    host_percentiles packet;
+    uint32_t scans, requests;
+    double scan_us;
+};
+
+static stream_cost run_stream(uint32_t packets, uint32_t loss_permille, bool synced) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, false, false, on_cmd, on_data);
+    std::vector<int64_t> cost;
+    stream_cost result = {};
+    uint32_t random = 1;
+    uint64_t scan_ns = 0;
+
+    if (!ctx) return result;
+    rtp_host_now = 1000000000000LL;
+    rtp_record(ctx, 0, 1);
+    if (synced) send_sync(ctx, 0, LATENCY);
+
+    for (uint32_t i = 0; i < packets; i++) {
+        rtp_host_now = 1000000000000LL + (int64_t)i * FRAME * 1000000 / 44100;
+        random ^= random << 13, random ^= random >> 17, random ^= random << 5;
+        if (i && random % 1000 < loss_permille) continue;
+
+        int64_t start = esp_timer_get_time();
+        send_audio(ctx, i);
+        cost.push_back(esp_timer_get_time() - start);
+    }
+
+    rtp_host_nack(ctx, &result.scans, &scan_ns, &result.requests);
+    result.packet = percentiles(cost);
+    result.scan_us = result.scans ? scan_ns / 1000.0 / result.scans : 0;
+    rtp_host_now = 0;
+    rtp_host_close(ctx);
+    return result;
+}
+
+// Once synced, frames go to the sink as they come and the buffer is drained
+// after each: the scan for holes has nothing to walk, and asks for nothing
+static void test_drained_scan(void) {
+    stream_cost clean = run_stream(1000, 0, true), lossy = run_stream(1000, 20, true);
+
+    printf("drained: %.2f us/packet, %u resend requests; 2%% loss: %u scans at %.2f us, %u requests\n",
+           clean.packet.mean, clean.requests, lossy.scans, lossy.scan_us, lossy.requests);
+    CHECK(clean.packet.mean < 20, "%.2f us per packet", clean.packet.mean);
+    CHECK(clean.requests == 0, "%u resend requests", clean.requests);
+    CHECK(lossy.scans >= 400, "%u scans", lossy.scans);
+    CHECK(lossy.requests > 0, "no resend request");
+}
+
+// Lead and depth are counted against the latency as packets reach the jitter
+// buffer: a drained buffer holds nothing, one waiting on a hole holds what
+// came after it, and the missing packet coming in 100 frames late still has
+// 60% of the latency left
+static void test_hist(void) {
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, false, false, on_cmd, on_data);
+    raop_stats_t stats;
+    uint32_t lead = 0, depth = 0;
+
+    CHECK(ctx, "cannot open a stream");
+    if (!ctx) return;
+
+    rtp_host_now = 1000000000000LL;
+    rtp_record(ctx, 0, 1);
+    send_sync(ctx, 0, LATENCY);
+    for (uint32_t i = 0; i <= 600; i++) {
+        rtp_host_now = 1000000000000LL + (int64_t)i * FRAME * 1000000 / 44100;
+        if (i != 500) send_audio(ctx, i);
+    }
+    send_audio(ctx, 500);
+
+    rtp_get_stats(ctx, &stats);
+    for (int i = 0; i < RAOP_HIST_BINS; i++) lead += stats.lead_hist[i], depth += stats.depth_hist[i];
+    printf("lead %u/%u/%u/%u/%u/%u/%u/%u, depth %u/%u/%u/%u/%u/%u/%u/%u\n", stats.lead_hist[0], stats.lead_hist[1],
+           stats.lead_hist[2], stats.lead_hist[3], stats.lead_hist[4], stats.lead_hist[5], stats.lead_hist[6],
+           stats.lead_hist[7], stats.depth_hist[0], stats.depth_hist[1], stats.depth_hist[2], stats.depth_hist[3],
+           stats.depth_hist[4], stats.depth_hist[5], stats.depth_hist[6], stats.depth_hist[7]);
+    CHECK(lead == 601 && depth == 601, "%u leads, %u depths for 601 packets", lead, depth);
+    CHECK(stats.lead_hist[0] == 0, "%u late", stats.lead_hist[0]);
+    CHECK(stats.lead_hist[3] == 1, "%u packets with 50-75%% of the latency left", stats.lead_hist[3]);
+    CHECK(stats.depth_hist[1] >= 500, "%u packets found the buffer near empty", stats.depth_hist[1]);
+    CHECK(stats.depth_hist[2] > 0, "no packet found frames held behind the hole");
+    CHECK(stats.depth_hist[7] == 0, "%u packets found more than the latency held", stats.depth_hist[7]);
+
+    rtp_host_now = 0;
+    rtp_host_close(ctx);
+}
+
+static void bench_packet(const char *name, uint32_t loss_permille, bool synced) {
+    stream_cost cost = run_stream(5000, loss_permille, synced);
+
+    printf("%s: %.2f us/packet mean, %.2f p99, %.2f max; %u scans at %.2f us, %u requests\n", name,
+           cost.packet.mean, cost.packet.p99, cost.packet.max, cost.scans, cost.scan_us, cost.requests);
+}
+
+// Three seconds of audio sent ten times faster than it plays, as a sender
+// fills the buffer at the start of a stream, each decode taking cost_us.
+// What matters is how long the RTP thread is away from its sockets per
+// packet, and how far behind the sender it falls: that much waits in the
+// socket queue, which is small on the device
+static void bench_burst(bool decoder, uint32_t cost_us) {
+    const uint32_t packets = 3 * 44100 / FRAME;
+    const int64_t interval = (int64_t)FRAME * 1000000 / 44100 / 10;
+    struct rtp_s *ctx = rtp_host_open(LATENCY, FMTP, false, decoder, on_cmd, on_data);
+    std::vector<int64_t> intake;
+    int64_t behind = 0;
+    uint32_t peak = 0, dropped = 0;
+
+    if (!ctx) return;
+    alac_host_cost_us = cost_us;
+    rtp_record(ctx, 0, 0);
+
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < packets; i++) {
+        int64_t due = start + i * interval, now = esp_timer_get_time();
+        if (now < due) usleep(due - now);
+        now = esp_timer_get_time();
+        behind = std::max(behind, now - due);
+        send_audio(ctx, i);
+        intake.push_back(esp_timer_get_time() - now);
+    }
+    int64_t sent = esp_timer_get_time();
+    rtp_host_settle(ctx);
+    int64_t settled = esp_timer_get_time();
+
+    rtp_host_decoder(ctx, &peak, &dropped);
+    host_percentiles p = percentiles(intake);
+    printf("%s, decode %u us: intake %.0f us mean, %.0f p99, %.0f max; sender ahead by %.1f ms (%.0f packets)\n",
+           decoder ? "decode task" : "RTP thread", cost_us, p.mean, p.p99, p.max, behind / 1000.0,
+           (double)behind / interval);
+    printf("    all placed %.1f ms after the last one, %u/%u ready, queue peak %u, %u dropped\n",
+           (settled - sent) / 1000.0, rtp_host_ready(ctx), packets, peak, dropped);
+
+    alac_host_cost_us = 0;
+    rtp_host_close(ctx);
+}
+
+int main(int argc, char **argv) {
+    bool bench = argc > 1 && !strcmp(argv[1], "--bench");
+
+    if (bench) {
+        bench_packet("not synced, filling", 0, false);
+        bench_packet("playing, no loss", 0, true);
+        bench_packet("playing, 1% loss", 10, true);
+        bench_packet("playing, 5% loss", 50, true);
+        bench_burst(false, 300);
+        bench_burst(true, 300);
+        bench_burst(false, 1000);
+        bench_burst(true, 1000);
+        return TEST_END();
+    }
+
+    test_wanted(false);
+    test_wanted(true);
+    test_lazy_flush();
+    test_lazy_pool();
+    test_sink_size(LATENCY);
+    test_sink_size(44100 * 10);
+    test_sink_size(0);
+    test_lazy_sink_size(LATENCY);
+    test_lazy_sink_size(44100 * 10);
+    test_drained_scan();
+    test_hist();
+    return TEST_END();
+}
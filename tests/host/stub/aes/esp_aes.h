@@ -0,0 +1,35 @@
+#pragma once
+
+// ESP-IDF AES driver over OpenSSL's block API
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/aes.h>
+
+#define ESP_AES_ENCRYPT 1
+#define ESP_AES_DECRYPT 0
+
+typedef struct {
+    AES_KEY encrypt, decrypt;
+} esp_aes_context;
+
+static inline void esp_aes_init(esp_aes_context *ctx) {
+    (void)ctx;
+}
+
+static inline void esp_aes_free(esp_aes_context *ctx) {
+    (void)ctx;
+}
+
+static inline int esp_aes_setkey(esp_aes_context *ctx, const unsigned char *key, unsigned bits) {
+    AES_set_encrypt_key(key, bits, &ctx->encrypt);
+    AES_set_decrypt_key(key, bits, &ctx->decrypt);
+    return 0;
+}
+
+static inline int esp_aes_crypt_cbc(esp_aes_context *ctx, int mode, size_t length, unsigned char iv[16],
+                                    const unsigned char *input, unsigned char *output) {
+    AES_cbc_encrypt(input, output, length, mode == ESP_AES_ENCRYPT ? &ctx->encrypt : &ctx->decrypt, iv,
+                    mode == ESP_AES_ENCRYPT ? AES_ENCRYPT : AES_DECRYPT);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Host build: an ALAC decoder that takes as long as it is told to. The frame
+// length comes from the magic cookie as with the real one, the PCM is the
+// packet repeated. Each call sleeps alac_host_cost_us rather than spin, so
+// that on a host with one CPU it stands for a decode on the other core
+
+#include "alac_wrapper.h"
+#include "alac_host.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct alac_codec_s {
+    unsigned frame_length;
+};
+
+std::atomic<uint32_t> alac_host_cost_us;
+std::atomic<uint32_t> alac_host_started;
+std::atomic<uint32_t> alac_host_decodes;
+
+struct alac_codec_s *alac_create_decoder(int magic_cookie_size, unsigned char *magic_cookie,
+                                         unsigned char *sample_size, unsigned *sample_rate,
+                                         unsigned char *channels, unsigned int *block_size) {
+    uint32_t frame_length;
+
+    if (magic_cookie_size < 4) return NULL;
+    memcpy(&frame_length, magic_cookie, 4);
+
+    struct alac_codec_s *codec = (struct alac_codec_s *)calloc(1, sizeof(struct alac_codec_s));
+    codec->frame_length = ntohl(frame_length);
+    *sample_size = 16;
+    *sample_rate = 44100;
+    *channels = 2;
+    *block_size = codec->frame_length;
+    return codec;
+}
+
+void alac_delete_decoder(struct alac_codec_s *codec) {
+    free(codec);
+}
+
+// The input length is not passed in, only its first 16 bytes are sure to be there
+bool alac_to_pcm(struct alac_codec_s *codec, unsigned char *input, unsigned char *output, char channels,
+                 unsigned *out_frames) {
+    uint32_t cost = alac_host_cost_us.load(std::memory_order_relaxed);
+
+    alac_host_started.fetch_add(1, std::memory_order_relaxed);
+    for (unsigned i = 0; i < codec->frame_length * channels * 2; i++) output[i] = input[i % 16];
+    if (cost) usleep(cost);
+
+    *out_frames = codec->frame_length;
+    alac_host_decodes.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+// Levels as in ESP-IDF, errors only by default: the tests provoke underruns
+// and late frames on purpose. HOST_LOG=<0..5> shows more.
+#ifdef __cplusplus
+extern "C" {
+#endif
+int host_log_level(void);
+#ifdef __cplusplus
+}
+#endif
+
+#define HOST_LOG(level, letter, tag, format, ...) \
+    do { \
+        if (host_log_level() >= level) fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(5, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,258 @@
+// Host build: FreeRTOS tasks, notifications, queues and timers over pthreads,
+// enough for the component's own threads to run as they do on the device
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct host_task_s {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t notified;
+    bool deleted;
+    TaskFunction_t fn;
+    void *arg;
+};
+
+struct host_queue_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *items;
+    UBaseType_t length, item_size, head, count;
+};
+
+struct host_timer_s {
+    void *id;
+    TimerCallbackFunction_t callback;
+};
+
+static thread_local struct host_task_s *current_task;
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int host_log_level(void) {
+    static int level = -1;
+    if (level < 0) {
+        const char *env = getenv("HOST_LOG");
+        level = env ? atoi(env) : 1;
+    }
+    return level;
+}
+
+// Absolute CLOCK_MONOTONIC deadline, ticks being milliseconds
+static void deadline(struct timespec *ts, TickType_t ticks) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// false on timeout
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, TickType_t ticks, const struct timespec *until) {
+    if (ticks == portMAX_DELAY) return pthread_cond_wait(cond, mutex) == 0;
+    return pthread_cond_timedwait(cond, mutex, until) != ETIMEDOUT;
+}
+
+static struct host_task_s *task_new(TaskFunction_t fn, void *arg) {
+    struct host_task_s *task = (struct host_task_s *)calloc(1, sizeof(struct host_task_s));
+    pthread_mutex_init(&task->mutex, NULL);
+    cond_init(&task->cond);
+    task->fn = fn;
+    task->arg = arg;
+    return task;
+}
+
+static void *task_run(void *arg) {
+    current_task = (struct host_task_s *)arg;
+    current_task->fn(current_task->arg);
+    return NULL;
+}
+
+// Tasks never return on FreeRTOS, they delete themselves. Handles are not
+// reclaimed: a host run is short and late notifications stay harmless.
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    struct host_task_s *task = task_new(fn, arg);
+    (void)name, (void)stack, (void)priority, (void)core;
+
+    if (pthread_create(&task->thread, NULL, task_run, task)) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle) *handle = task;
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                           UBaseType_t priority, StackType_t *stack_buffer,
+                                           StaticTask_t *task_buffer, BaseType_t core) {
+    TaskHandle_t task = NULL;
+    (void)stack_buffer, (void)task_buffer;
+    xTaskCreatePinnedToCore(fn, name, stack, arg, priority, &task, core);
+    return task;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    // Threads not created here (main) get a handle on first use
+    if (!current_task) current_task = task_new(NULL, NULL);
+    return current_task;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (!task || task == current_task) pthread_exit(NULL);
+
+    // Another task, which can only be parked in vTaskSuspend(NULL)
+    pthread_mutex_lock(&task->mutex);
+    task->deleted = true;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+}
+
+void vTaskSuspend(TaskHandle_t task) {
+    if (task && task != current_task) return;
+    task = xTaskGetCurrentTaskHandle();
+
+    pthread_mutex_lock(&task->mutex);
+    while (!task->deleted) pthread_cond_wait(&task->cond, &task->mutex);
+    pthread_mutex_unlock(&task->mutex);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = { (time_t)(ticks / 1000), (long)(ticks % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->mutex);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    struct host_task_s *task = xTaskGetCurrentTaskHandle();
+    struct timespec until;
+    uint32_t value;
+
+    deadline(&until, ticks);
+    pthread_mutex_lock(&task->mutex);
+    while (!task->notified && ticks && cond_wait(&task->cond, &task->mutex, ticks, &until));
+    value = task->notified;
+    if (value) task->notified = clear ? 0 : value - 1;
+    pthread_mutex_unlock(&task->mutex);
+    return value;
+}
+
+/*---------------------------------------------------------------------------*/
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct host_queue_s *queue = (struct host_queue_s *)calloc(1, sizeof(struct host_queue_s));
+    pthread_mutex_init(&queue->mutex, NULL);
+    cond_init(&queue->cond);
+    queue->items = (uint8_t *)malloc(length * item_size);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    if (!queue) return;
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    struct timespec until;
+
+    deadline(&until, ticks);
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->length && ticks && cond_wait(&queue->cond, &queue->mutex, ticks, &until));
+    if (queue->count == queue->length) {
+        pthread_mutex_unlock(&queue->mutex);
+        return pdFAIL;
+    }
+    memcpy(queue->items + ((queue->head + queue->count) % queue->length) * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    struct timespec until;
+
+    deadline(&until, ticks);
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->count && ticks && cond_wait(&queue->cond, &queue->mutex, ticks, &until));
+    if (!queue->count) {
+        pthread_mutex_unlock(&queue->mutex);
+        return pdFAIL;
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->mutex);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+/*---------------------------------------------------------------------------*/
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload, void *id,
+                           TimerCallbackFunction_t callback) {
+    struct host_timer_s *timer = (struct host_timer_s *)calloc(1, sizeof(struct host_timer_s));
+    (void)name, (void)period, (void)reload;
+    timer->id = id;
+    timer->callback = callback;
+    return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks) {
+    (void)ticks;
+    timer->callback(timer);
+    return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks) {
+    (void)ticks;
+    free(timer);
+    return pdPASS;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+    return timer->id;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// Host build: the FreeRTOS API the component uses, over pthreads
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint8_t StackType_t;
+typedef struct { void *task; } StaticTask_t;
+typedef struct host_task_s *TaskHandle_t;
+typedef struct host_queue_s *QueueHandle_t;
+typedef struct host_timer_s *TimerHandle_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY ((TickType_t)0xffffffffu)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7fffffff
+#define portNUM_PROCESSORS 2
+#define configMAX_PRIORITIES 25